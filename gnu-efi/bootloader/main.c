@@ -127,6 +127,50 @@ typedef struct {
 	void* rsdp;
 } BootInfo;
 
+// The kernel runs in the higher half: its image at the p_vaddr of its segments, and a direct
+// map of physical memory at 0xffff800000000000 (PML4 slot 256), see kernel/src/paging/DirectMap.h
+#define DIRECT_MAP_SLOT 256
+#define KERNEL_SLOT 511
+#define PAGE_PRESENT_WRITE 0x3
+#define PAGE_ADDRESS_MASK 0x000ffffffffff000
+
+UINT64* AllocateTable(EFI_SYSTEM_TABLE* SystemTable){
+	EFI_PHYSICAL_ADDRESS table;
+	SystemTable->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, 1, &table);
+	SetMem((void*)table, 0x1000, 0);
+	return (UINT64*)table;
+}
+
+UINT64* NextTable(UINT64* table, UINTN index, EFI_SYSTEM_TABLE* SystemTable){
+	if (!(table[index] & 1)){
+		table[index] = (UINT64)AllocateTable(SystemTable) | PAGE_PRESENT_WRITE;
+	}
+	return (UINT64*)(table[index] & PAGE_ADDRESS_MASK);
+}
+
+void MapKernelPage(UINT64* pml4, UINT64 virt, UINT64 phys, EFI_SYSTEM_TABLE* SystemTable){
+	UINT64* pdp = NextTable(pml4, (virt >> 39) & 0x1ff, SystemTable);
+	UINT64* pd = NextTable(pdp, (virt >> 30) & 0x1ff, SystemTable);
+	UINT64* pt = NextTable(pd, (virt >> 21) & 0x1ff, SystemTable);
+	pt[(virt >> 12) & 0x1ff] = phys | PAGE_PRESENT_WRITE;
+}
+
+// Keeps the firmware's identity map in the low half, where the loader itself runs, and
+// reuses its tables a second time for the direct map. The kernel builds its own tables
+// early on and never touches these again.
+UINT64* CreateKernelPageTables(EFI_SYSTEM_TABLE* SystemTable){
+	UINT64 firmwareCR3;
+	asm volatile ("mov %%cr3, %0" : "=r"(firmwareCR3));
+	UINT64* firmwarePML4 = (UINT64*)(firmwareCR3 & PAGE_ADDRESS_MASK);
+
+	UINT64* pml4 = AllocateTable(SystemTable);
+	for (UINTN i = 0; i < DIRECT_MAP_SLOT; i++){
+		pml4[i] = firmwarePML4[i];
+		if (DIRECT_MAP_SLOT + i < KERNEL_SLOT) pml4[DIRECT_MAP_SLOT + i] = firmwarePML4[i];
+	}
+	return pml4;
+}
+
 UINTN strcmp(CHAR8* a, CHAR8* b, UINTN length){
 	for (UINTN i = 0; i < length; i++){
 		if (*a != *b) return 0;
@@ -182,6 +226,8 @@ EFI_STATUS efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
 		Kernel->Read(Kernel, &size, phdrs);
 	}
 
+	UINT64* kernelPML4 = CreateKernelPageTables(SystemTable);
+
 	for (
 		Elf64_Phdr* phdr = phdrs;
 		(char*)phdr < (char*)phdrs + header.e_phnum * header.e_phentsize;
@@ -198,6 +244,12 @@ EFI_STATUS efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
 				Kernel->SetPosition(Kernel, phdr->p_offset);
 				UINTN size = phdr->p_filesz;
 				Kernel->Read(Kernel, &size, (void*)segment);
+				SetMem((void*)(segment + phdr->p_filesz), phdr->p_memsz - phdr->p_filesz, 0); // .bss
+
+				// loaded at p_paddr, runs at p_vaddr
+				for (int page = 0; page < pages; page++){
+					MapKernelPage(kernelPML4, phdr->p_vaddr + page * 0x1000, segment + page * 0x1000, SystemTable);
+				}
 				break;
 			}
 		}
@@ -268,6 +320,9 @@ EFI_STATUS efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
 		return exitStatus;
 	}
 
+	// e_entry is a higher half address, only mapped by the kernel's tables
+	asm volatile ("mov %0, %%cr3" : : "r"(kernelPML4) : "memory");
+
 	// Call kernel with boot info
 	KernelStart(&bootInfo);
 
@@ -1,4 +1,7 @@
 #include "BasicRenderer.h"
+#include "IO.h"
+#include "memory.h"
+#include "memory/vmalloc.h"
 
 BasicRenderer* GlobalRenderer;
 
@@ -7,15 +10,220 @@ BasicRenderer::BasicRenderer(Framebuffer* targetFramebuffer, PSF1_FONT* psf1_Fon
     TargetFramebuffer = targetFramebuffer;
     PSF1_Font = psf1_Font;
     Colour = 0xffffffff;
+    ClearColour = 0;
     CursorPosition = {0, 0};
+    MouseDrawn = false;
+    BackBuffer = NULL;
+    FlushOnTick = false;
+    History = NULL;
+    DirtyCount = 0;
+    ScrollRow = 0;
+    HistoryHead = 0;
+    HistoryColumns = 0;
+    ViewOffset = 0;
+}
+
+// Pixel row y of the screen. The back buffer is a ring of rows starting at ScrollRow, so
+// scrolling moves the start instead of the pixels
+uint32_t* BasicRenderer::Row(uint32_t y){
+    uint64_t stride = TargetFramebuffer->PixelsPerScanLine;
+    if (BackBuffer == NULL) return (uint32_t*)TargetFramebuffer->BaseAddress + y * stride;
+
+    y += ScrollRow;
+    if (y >= TargetFramebuffer->Height) y -= TargetFramebuffer->Height;
+    return BackBuffer + y * stride;
+}
+
+bool BasicRenderer::EnableBackBuffer(){
+    if (BackBuffer != NULL) return true;
+
+    uint64_t size = (uint64_t)TargetFramebuffer->PixelsPerScanLine * TargetFramebuffer->Height * 4;
+    uint32_t* buffer = (uint32_t*)vmalloc(size);
+    if (buffer == NULL) return false;
+
+    // the one read of the framebuffer: everything drawn so far carries over
+    memcpy(buffer, TargetFramebuffer->BaseAddress, size);
+    DirtyCount = 0;
+    ScrollRow = 0;
+    BackBuffer = buffer;
+    return true;
+}
+
+// Rectangles that overlap or touch an existing one are merged into it; once the list is full
+// everything collapses into one bounding box, which costs a bigger copy but never loses damage
+void BasicRenderer::MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height){
+    if (BackBuffer == NULL) return;
+    if (x >= TargetFramebuffer->Width || y >= TargetFramebuffer->Height) return;
+    if (width > TargetFramebuffer->Width - x) width = TargetFramebuffer->Width - x;
+    if (height > TargetFramebuffer->Height - y) height = TargetFramebuffer->Height - y;
+    if (width == 0 || height == 0) return;
+
+    DirtyRect rect = {x, y, x + width, y + height};
+
+    uint64_t flags = DisableInterrupts();
+    for (uint32_t i = 0; i < DirtyCount; i++){
+        DirtyRect* other = &Dirty[i];
+        if (rect.x0 > other->x1 || other->x0 > rect.x1) continue;
+        if (rect.y0 > other->y1 || other->y0 > rect.y1) continue;
+
+        if (rect.x0 < other->x0) other->x0 = rect.x0;
+        if (rect.y0 < other->y0) other->y0 = rect.y0;
+        if (rect.x1 > other->x1) other->x1 = rect.x1;
+        if (rect.y1 > other->y1) other->y1 = rect.y1;
+        RestoreInterrupts(flags);
+        return;
+    }
+
+    if (DirtyCount == RENDERER_MAX_DIRTY){
+        for (uint32_t i = 0; i < DirtyCount; i++){
+            if (Dirty[i].x0 < rect.x0) rect.x0 = Dirty[i].x0;
+            if (Dirty[i].y0 < rect.y0) rect.y0 = Dirty[i].y0;
+            if (Dirty[i].x1 > rect.x1) rect.x1 = Dirty[i].x1;
+            if (Dirty[i].y1 > rect.y1) rect.y1 = Dirty[i].y1;
+        }
+        DirtyCount = 0;
+    }
+    Dirty[DirtyCount++] = rect;
+    RestoreInterrupts(flags);
+}
+
+// Copies each damaged span row by row; memcpy picks the widest stores the CPU has, so callers
+// in interrupt context must be inside a KernelFPUBegin/End section
+void BasicRenderer::Flush(){
+    if (BackBuffer == NULL) return;
+
+    DirtyRect pending[RENDERER_MAX_DIRTY];
+    uint64_t flags = DisableInterrupts();
+    uint32_t count = DirtyCount;
+    for (uint32_t i = 0; i < count; i++) pending[i] = Dirty[i];
+    DirtyCount = 0;
+    RestoreInterrupts(flags);
+
+    uint64_t stride = TargetFramebuffer->PixelsPerScanLine;
+    uint32_t* framebuffer = (uint32_t*)TargetFramebuffer->BaseAddress;
+    for (uint32_t i = 0; i < count; i++){
+        DirtyRect* rect = &pending[i];
+        uint64_t spanBytes = (uint64_t)(rect->x1 - rect->x0) * 4;
+        for (uint32_t y = rect->y0; y < rect->y1; y++){
+            memcpy(framebuffer + y * stride + rect->x0, Row(y) + rect->x0, spanBytes);
+        }
+    }
+}
+
+bool BasicRenderer::EnableScrollback(){
+    if (History != NULL) return true;
+
+    uint32_t columns = TargetFramebuffer->Width / 8;
+    uint64_t size = (uint64_t)CONSOLE_HISTORY_LINES * columns * sizeof(ConsoleCell);
+    ConsoleCell* history = (ConsoleCell*)vmalloc(size);
+    if (history == NULL) return false;
+
+    // text already on screen was never recorded, so its lines start out blank
+    memset(history, 0, size);
+    HistoryColumns = columns;
+    HistoryHead = CursorPosition.Y / 16;
+    ViewOffset = 0;
+    History = history;
+    return true;
+}
+
+ConsoleCell* BasicRenderer::HistoryLine(uint64_t line){
+    return History + (line % CONSOLE_HISTORY_LINES) * HistoryColumns;
+}
+
+// Moves the view lines back into the scrollback (or forward, when negative) and repaints
+// the screen from the recorded text. Output snaps the view back to the live screen.
+void BasicRenderer::ScrollView(long lines){
+    if (History == NULL) return;
+
+    uint64_t cursorLine = CursorPosition.Y / 16;
+    uint64_t oldest = 0;
+    if (HistoryHead >= CONSOLE_HISTORY_LINES) oldest = HistoryHead - CONSOLE_HISTORY_LINES + 1;
+    long maxOffset = 0;
+    if (HistoryHead - cursorLine > oldest) maxOffset = HistoryHead - cursorLine - oldest;
+
+    long offset = ViewOffset + lines;
+    if (offset < 0) offset = 0;
+    if (offset > maxOffset) offset = maxOffset;
+    if (offset == ViewOffset) return;
+
+    ViewOffset = offset;
+    Redraw();
+}
+
+void BasicRenderer::Redraw(){
+    FillRows(0, TargetFramebuffer->Height);
+
+    uint64_t oldest = 0;
+    if (HistoryHead >= CONSOLE_HISTORY_LINES) oldest = HistoryHead - CONSOLE_HISTORY_LINES + 1;
+    uint64_t top = HistoryHead - CursorPosition.Y / 16 - ViewOffset;
+
+    uint32_t screenLines = TargetFramebuffer->Height / 16;
+    for (uint32_t screenLine = 0; screenLine < screenLines; screenLine++){
+        uint64_t line = top + screenLine;
+        if (line < oldest) continue;
+        if (line > HistoryHead) break;
+
+        ConsoleCell* cells = HistoryLine(line);
+        for (uint32_t column = 0; column < HistoryColumns; column++){
+            if (cells[column].chr == 0) continue;
+            DrawGlyph(cells[column].chr, cells[column].colour, column * 8, screenLine * 16);
+        }
+    }
+    MarkDirty(0, 0, TargetFramebuffer->Width, TargetFramebuffer->Height);
+}
+
+void BasicRenderer::FillRows(uint32_t y0, uint32_t y1){
+    uint64_t stride = TargetFramebuffer->PixelsPerScanLine;
+    for (uint32_t y = y0; y < y1; y++){
+        uint32_t* row = Row(y);
+        for (uint64_t x = 0; x < stride; x++){
+            row[x] = ClearColour;
+        }
+    }
+}
+
+// With the back buffer this is an advance of the ring start plus clearing the exposed rows;
+// the flush then rewrites the whole screen once, however many lines scrolled since the last one.
+// Without it the framebuffer contents are moved in one bulk copy.
+void BasicRenderer::Scroll(){
+    uint32_t height = TargetFramebuffer->Height;
+    if (height < 32) return;
+
+    if (BackBuffer != NULL){
+        ScrollRow += 16;
+        if (ScrollRow >= height) ScrollRow -= height;
+    }
+    else {
+        uint64_t stride = TargetFramebuffer->PixelsPerScanLine;
+        uint32_t* framebuffer = (uint32_t*)TargetFramebuffer->BaseAddress;
+        memmove(framebuffer, framebuffer + 16 * stride, (uint64_t)(height - 16) * stride * 4);
+    }
+
+    CursorPosition.Y -= 16;
+    FillRows(CursorPosition.Y, height);
+    MarkDirty(0, 0, TargetFramebuffer->Width, height);
+}
+
+void BasicRenderer::NewLine(){
+    CursorPosition.X = 0;
+    CursorPosition.Y += 16;
+
+    if (History != NULL){
+        HistoryHead++;
+        memset(HistoryLine(HistoryHead), 0, HistoryColumns * sizeof(ConsoleCell));
+    }
+
+    if (CursorPosition.Y + 16 > TargetFramebuffer->Height) Scroll();
 }
 
 void BasicRenderer::PutPix(uint32_t x, uint32_t y, uint32_t colour){
-    *(uint32_t*)((uint64_t)TargetFramebuffer->BaseAddress + (x*4) + (y * TargetFramebuffer->PixelsPerScanLine * 4)) = colour;
+    Row(y)[x] = colour;
+    MarkDirty(x, y, 1, 1);
 }
 
 uint32_t BasicRenderer::GetPix(uint32_t x, uint32_t y){
-    return *(uint32_t*)((uint64_t)TargetFramebuffer->BaseAddress + (x*4) + (y * TargetFramebuffer->PixelsPerScanLine * 4));
+    return Row(y)[x];
 }
 
 void BasicRenderer::ClearMouseCursor(uint8_t* mouseCursor, Point position){
@@ -30,17 +238,20 @@ void BasicRenderer::ClearMouseCursor(uint8_t* mouseCursor, Point position){
     if (differenceY < 16) yMax = differenceY;
 
     for (int y = 0; y < yMax; y++){
+        uint32_t* row = Row(position.Y + y);
         for (int x = 0; x < xMax; x++){
             int bit = y * 16 + x;
             int byte = bit / 8;
             if ((mouseCursor[byte] & (0b10000000 >> (x % 8))))
             {
-                if (GetPix(position.X + x, position.Y + y) == MouseCursorBufferAfter[x + y *16]){
-                    PutPix(position.X + x, position.Y + y, MouseCursorBuffer[x + y * 16]);
+                uint32_t* pixel = row + position.X + x;
+                if (*pixel == MouseCursorBufferAfter[x + y *16]){
+                    *pixel = MouseCursorBuffer[x + y * 16];
                 }
             }
         }
     }
+    MarkDirty(position.X, position.Y, xMax, yMax);
 }
 
 void BasicRenderer::DrawOverlayMouseCursor(uint8_t* mouseCursor, Point position, uint32_t colour){
@@ -55,40 +266,44 @@ void BasicRenderer::DrawOverlayMouseCursor(uint8_t* mouseCursor, Point position,
     if (differenceY < 16) yMax = differenceY;
 
     for (int y = 0; y < yMax; y++){
+        uint32_t* row = Row(position.Y + y);
         for (int x = 0; x < xMax; x++){
             int bit = y * 16 + x;
             int byte = bit / 8;
             if ((mouseCursor[byte] & (0b10000000 >> (x % 8))))
             {
-                MouseCursorBuffer[x + y * 16] = GetPix(position.X + x, position.Y + y);
-                PutPix(position.X + x, position.Y + y, colour);
-                MouseCursorBufferAfter[x + y * 16] = GetPix(position.X + x, position.Y + y);
+                uint32_t* pixel = row + position.X + x;
+                MouseCursorBuffer[x + y * 16] = *pixel;
+                *pixel = colour;
+                MouseCursorBufferAfter[x + y * 16] = *pixel;
 
             }
         }
     }
+    MarkDirty(position.X, position.Y, xMax, yMax);
 
     MouseDrawn = true;
 }
 
 void BasicRenderer::Clear(){
-    uint64_t fbBase = (uint64_t)TargetFramebuffer->BaseAddress;
-    uint64_t bytesPerScanline = TargetFramebuffer->PixelsPerScanLine * 4;
-    uint64_t fbHeight = TargetFramebuffer->Height;
-    uint64_t fbSize = TargetFramebuffer->BufferSize;
-
-    for (int verticalScanline = 0; verticalScanline < fbHeight; verticalScanline ++){
-        uint64_t pixPtrBase = fbBase + (bytesPerScanline * verticalScanline);
-        for (uint32_t* pixPtr = (uint32_t*)pixPtrBase; pixPtr < (uint32_t*)(pixPtrBase + bytesPerScanline); pixPtr ++){
-            *pixPtr = ClearColour;
-        }
+    FillRows(0, TargetFramebuffer->Height);
+    MarkDirty(0, 0, TargetFramebuffer->Width, TargetFramebuffer->Height);
+
+    // the cleared screen starts a fresh line of history at the top
+    CursorPosition = {0, 0};
+    ViewOffset = 0;
+    if (History != NULL){
+        HistoryHead++;
+        memset(HistoryLine(HistoryHead), 0, HistoryColumns * sizeof(ConsoleCell));
     }
 }
 
 void BasicRenderer::ClearChar(){
+    if (ViewOffset != 0) ScrollView(-ViewOffset);
 
     if (CursorPosition.X == 0){
         CursorPosition.X = TargetFramebuffer->Width;
+        if (CursorPosition.Y >= 16 && History != NULL) HistoryHead--;
         CursorPosition.Y -= 16;
         if (CursorPosition.Y < 0) CursorPosition.Y = 0;
     }
@@ -96,17 +311,22 @@ void BasicRenderer::ClearChar(){
     unsigned int xOff = CursorPosition.X;
     unsigned int yOff = CursorPosition.Y;
 
-    unsigned int* pixPtr = (unsigned int*)TargetFramebuffer->BaseAddress;
     for (unsigned long y = yOff; y < yOff + 16; y++){
+        unsigned int* pixPtr = Row(y);
         for (unsigned long x = xOff - 8; x < xOff; x++){
-                    *(unsigned int*)(pixPtr + x + (y * TargetFramebuffer->PixelsPerScanLine)) = ClearColour;
+                    pixPtr[x] = ClearColour;
         }
     }
+    MarkDirty(xOff - 8, yOff, 8, 16);
+
+    uint32_t column = (xOff - 8) / 8;
+    if (History != NULL && column < HistoryColumns) HistoryLine(HistoryHead)[column].chr = 0;
 
     CursorPosition.X -= 8;
 
     if (CursorPosition.X < 0){
         CursorPosition.X = TargetFramebuffer->Width;
+        if (CursorPosition.Y >= 16 && History != NULL) HistoryHead--;
         CursorPosition.Y -= 16;
         if (CursorPosition.Y < 0) CursorPosition.Y = 0;
     }
@@ -114,8 +334,11 @@ void BasicRenderer::ClearChar(){
 }
 
 void BasicRenderer::Next(){
-    CursorPosition.X = 0;
-    CursorPosition.Y += 16;
+    if (ViewOffset != 0) ScrollView(-ViewOffset);
+    NewLine();
+
+    // a finished line is worth showing now if no timer tick is going to flush it
+    if (BackBuffer != NULL && (!FlushOnTick || !InterruptsEnabled())) Flush();
 }
 
 void BasicRenderer::Print(const char* str)
@@ -123,38 +346,46 @@ void BasicRenderer::Print(const char* str)
     
     char* chr = (char*)str;
     while(*chr != 0){
-        PutChar(*chr, CursorPosition.X, CursorPosition.Y);
-        CursorPosition.X+=8;
-        if(CursorPosition.X + 8 > TargetFramebuffer->Width)
-        {
-            CursorPosition.X = 0;
-            CursorPosition.Y += 16;
-        }
+        PutChar(*chr);
         chr++;
     }
 }
 
 void BasicRenderer::PutChar(char chr, unsigned int xOff, unsigned int yOff)
 {
-    unsigned int* pixPtr = (unsigned int*)TargetFramebuffer->BaseAddress;
+    DrawGlyph(chr, Colour, xOff, yOff);
+}
+
+void BasicRenderer::DrawGlyph(char chr, uint32_t colour, unsigned int xOff, unsigned int yOff)
+{
+    if (xOff + 8 > TargetFramebuffer->Width || yOff + 16 > TargetFramebuffer->Height) return;
+
     char* fontPtr = (char*)PSF1_Font->glyphBuffer + (chr * PSF1_Font->psf1_Header->charsize);
     for (unsigned long y = yOff; y < yOff + 16; y++){
+        unsigned int* pixPtr = Row(y);
         for (unsigned long x = xOff; x < xOff+8; x++){
             if ((*fontPtr & (0b10000000 >> (x - xOff))) > 0){
-                    *(unsigned int*)(pixPtr + x + (y * TargetFramebuffer->PixelsPerScanLine)) = Colour;
+                    pixPtr[x] = colour;
                 }
 
         }
         fontPtr++;
     }
+    MarkDirty(xOff, yOff, 8, 16);
 }
 
 void BasicRenderer::PutChar(char chr)
 {
+    if (ViewOffset != 0) ScrollView(-ViewOffset);
+
     PutChar(chr, CursorPosition.X, CursorPosition.Y);
-    CursorPosition.X += 8;
-    if (CursorPosition.X + 8 > TargetFramebuffer->Width){
-        CursorPosition.X = 0; 
-        CursorPosition.Y += 16;
+    uint32_t column = CursorPosition.X / 8;
+    if (History != NULL && column < HistoryColumns){
+        ConsoleCell* cell = &HistoryLine(HistoryHead)[column];
+        cell->chr = chr;
+        cell->colour = Colour;
     }
-}
\ No newline at end of file
+
+    CursorPosition.X += 8;
+    if (CursorPosition.X + 8 > TargetFramebuffer->Width) NewLine();
+}
@@ -4,6 +4,20 @@
 #include "simpleFonts.h" 
 #include <stdint.h>
 
+#define RENDERER_MAX_DIRTY 16 // damaged rectangles tracked before they collapse into their bounding box
+
+#define CONSOLE_HISTORY_LINES 1024 // scrollback kept in RAM, screen included
+
+struct ConsoleCell {
+    char chr; // 0 for an empty cell
+    uint32_t colour;
+};
+
+struct DirtyRect {
+    uint32_t x0, y0; // inclusive
+    uint32_t x1, y1; // exclusive
+};
+
 class BasicRenderer{
     public:
     BasicRenderer(Framebuffer* targetFramebuffer, PSF1_FONT* psf1_Font);
@@ -25,6 +39,34 @@ class BasicRenderer{
     void DrawOverlayMouseCursor(uint8_t* mouseCursor, Point position, uint32_t colour);
     void ClearMouseCursor(uint8_t* mouseCursor, Point position);
     bool MouseDrawn;
+
+    // With a back buffer all drawing goes to RAM and Flush copies the damaged rectangles
+    // to the framebuffer, which is then never read
+    bool EnableBackBuffer();
+    void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    void Flush();
+    uint32_t* BackBuffer;
+    bool FlushOnTick; // the PIT handler calls Flush
+
+    // Text written through PutChar/Print/Next is recorded so the view can be scrolled back
+    bool EnableScrollback();
+    void ScrollView(long lines);
+    ConsoleCell* History;
+
+    private:
+    DirtyRect Dirty[RENDERER_MAX_DIRTY];
+    uint32_t DirtyCount;
+    uint32_t ScrollRow;
+    uint64_t HistoryHead; // line the cursor is on, counted from the first recorded line
+    uint32_t HistoryColumns;
+    long ViewOffset; // lines the view is scrolled back
+    uint32_t* Row(uint32_t y);
+    void FillRows(uint32_t y0, uint32_t y1);
+    void DrawGlyph(char chr, uint32_t colour, unsigned int xOff, unsigned int yOff);
+    void NewLine();
+    void Scroll();
+    void Redraw();
+    ConsoleCell* HistoryLine(uint64_t line);
 };
 
 extern BasicRenderer* GlobalRenderer;
\ No newline at end of file
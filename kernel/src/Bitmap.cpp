@@ -1,14 +1,21 @@
 #include "Bitmap.h"
 
+static inline uint64_t PopCount(uint64_t value){
+    value = value - ((value >> 1) & 0x5555555555555555);
+    value = (value & 0x3333333333333333) + ((value >> 2) & 0x3333333333333333);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0f;
+    return (value * 0x0101010101010101) >> 56;
+}
+
 bool Bitmap::operator[](uint64_t index){
     return Get(index);
 }
 
 bool Bitmap::Get(uint64_t index){
-    if (index > Size * 8) return false;
+    if (index >= Size * 8) return false;
     uint64_t byteIndex = index / 8;
     uint8_t bitIndex = index % 8;
-    uint8_t bitIndexer = 0b10000000 >> bitIndex;
+    uint8_t bitIndexer = 1 << bitIndex;
     if ((Buffer[byteIndex] & bitIndexer) > 0){
         return true;
     }
@@ -16,13 +23,79 @@ bool Bitmap::Get(uint64_t index){
 }
 
 bool Bitmap::Set(uint64_t index, bool value){
-    if (index > Size * 8) return false;
+    if (index >= Size * 8) return false;
     uint64_t byteIndex = index / 8;
     uint8_t bitIndex = index % 8;
-    uint8_t bitIndexer = 0b10000000 >> bitIndex;
+    uint8_t bitIndexer = 1 << bitIndex;
     Buffer[byteIndex] &= ~bitIndexer;
     if (value){
         Buffer[byteIndex] |= bitIndexer;
     }
     return true;
+}
+
+// Returns the first index in [start, end) whose bit differs from invert, or end if there is none
+uint64_t Bitmap::FindFirst(uint64_t start, uint64_t end, uint64_t invert){
+    if (end > Size * 8) end = Size * 8;
+    if (start >= end) return end;
+
+    uint64_t* words = (uint64_t*)Buffer;
+    uint64_t wordIndex = start / 64;
+    uint64_t word = (words[wordIndex] ^ invert) & (~(uint64_t)0 << (start % 64));
+
+    while (word == 0){
+        wordIndex++;
+        if (wordIndex * 64 >= end) return end;
+        word = words[wordIndex] ^ invert;
+    }
+
+    uint64_t index = wordIndex * 64 + __builtin_ctzll(word); // bsf/tzcnt
+    return index < end ? index : end;
+}
+
+uint64_t Bitmap::FindFirstClear(uint64_t start, uint64_t end){
+    return FindFirst(start, end, ~(uint64_t)0);
+}
+
+uint64_t Bitmap::FindFirstSet(uint64_t start, uint64_t end){
+    return FindFirst(start, end, 0);
+}
+
+// Fills whole words where possible and returns how many bits actually changed
+uint64_t Bitmap::FillRange(uint64_t start, uint64_t count, bool value){
+    if (start >= Size * 8) return 0;
+    if (count > Size * 8 - start) count = Size * 8 - start;
+
+    uint64_t* words = (uint64_t*)Buffer;
+    uint64_t end = start + count;
+    uint64_t changed = 0;
+
+    while (start < end){
+        uint64_t bit = start % 64;
+        uint64_t span = 64 - bit;
+        if (span > end - start) span = end - start;
+        uint64_t mask = span == 64 ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1) << bit;
+
+        uint64_t* word = &words[start / 64];
+        if (value){
+            changed += PopCount(~*word & mask);
+            *word |= mask;
+        }
+        else
+        {
+            changed += PopCount(*word & mask);
+            *word &= ~mask;
+        }
+        start += span;
+    }
+
+    return changed;
+}
+
+uint64_t Bitmap::SetRange(uint64_t start, uint64_t count){
+    return FillRange(start, count, true);
+}
+
+uint64_t Bitmap::ClearRange(uint64_t start, uint64_t count){
+    return FillRange(start, count, false);
 }
\ No newline at end of file
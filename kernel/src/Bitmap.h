@@ -2,6 +2,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Bits are stored LSB-first so the buffer can be scanned a uint64_t at a time.
+// The word operations expect Buffer to be 8-byte aligned and Size a multiple of 8.
 class Bitmap{
     public:
     size_t Size;
@@ -9,4 +11,12 @@ class Bitmap{
     bool operator[](uint64_t index);
     bool Set(uint64_t index, bool value);
     bool Get(uint64_t index);
+    uint64_t FindFirstClear(uint64_t start, uint64_t end);
+    uint64_t FindFirstSet(uint64_t start, uint64_t end);
+    uint64_t SetRange(uint64_t start, uint64_t count);
+    uint64_t ClearRange(uint64_t start, uint64_t count);
+
+    private:
+    uint64_t FindFirst(uint64_t start, uint64_t end, uint64_t invert);
+    uint64_t FillRange(uint64_t start, uint64_t count, bool value);
 };
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "BitmapSummary.h"
+#include "memory.h"
+
+static inline size_t LevelSize(uint64_t bitCount){
+    return ((bitCount + 63) / 64) * 8;
+}
+
+size_t BitmapSummary::MetadataSize(uint64_t bitCount){
+    size_t size = 0;
+    for (uint8_t level = 0; level < SUMMARY_MAX_LEVELS && bitCount > 64; level++){
+        bitCount = (bitCount + 63) / 64;
+        size += LevelSize(bitCount);
+    }
+    return size;
+}
+
+void BitmapSummary::Init(Bitmap* base, void* buffer){
+    Base = base;
+    LevelCount = 0;
+
+    uint64_t bitCount = base->Size * 8;
+    uint8_t* levelBuffer = (uint8_t*)buffer;
+    while (LevelCount < SUMMARY_MAX_LEVELS && bitCount > 64){
+        bitCount = (bitCount + 63) / 64;
+        Levels[LevelCount].Size = LevelSize(bitCount);
+        Levels[LevelCount].Buffer = levelBuffer;
+        memset(levelBuffer, 0, Levels[LevelCount].Size);
+        levelBuffer += Levels[LevelCount].Size;
+        LevelCount++;
+    }
+
+    Update(0, base->Size * 8);
+}
+
+// Refreshes the summary bits covering [start, start + count) after the base changed
+void BitmapSummary::Update(uint64_t start, uint64_t count){
+    if (count == 0) return;
+
+    uint64_t first = start / 64;
+    uint64_t last = (start + count - 1) / 64;
+    uint64_t* words = (uint64_t*)Base->Buffer;
+    uint64_t wordCount = Base->Size / 8;
+
+    for (uint8_t level = 0; level < LevelCount; level++){
+        if (last >= wordCount) last = wordCount - 1;
+
+        bool changed = false;
+        for (uint64_t w = first; w <= last; w++){
+            bool available = level == 0 ? words[w] != ~(uint64_t)0 : words[w] != 0;
+            if (Levels[level].Get(w) != available){
+                Levels[level].Set(w, available);
+                changed = true;
+            }
+        }
+        if (!changed) return;
+
+        words = (uint64_t*)Levels[level].Buffer;
+        wordCount = Levels[level].Size / 8;
+        first /= 64;
+        last /= 64;
+    }
+}
+
+Bitmap* BitmapSummary::LevelBitmap(uint8_t level){
+    return level == 0 ? Base : &Levels[level - 1];
+}
+
+// First clear (base) or set (summary) bit at or after index inside the word that holds index
+uint64_t BitmapSummary::FindInWord(uint8_t level, uint64_t index){
+    uint64_t wordEnd = (index / 64 + 1) * 64;
+    if (level == 0) return Base->FindFirstClear(index, wordEnd);
+    return Levels[level - 1].FindFirstSet(index, wordEnd);
+}
+
+uint64_t BitmapSummary::FindFirstClear(uint64_t start){
+    uint64_t bitCount = Base->Size * 8;
+
+    // climb until some word at or after start has something available
+    uint64_t index = start;
+    uint8_t level = 0;
+    uint64_t found;
+    while (true){
+        uint64_t levelBits = LevelBitmap(level)->Size * 8;
+        if (index >= levelBits) return bitCount;
+
+        if (level == LevelCount){
+            found = level == 0 ? Base->FindFirstClear(index, levelBits) : Levels[level - 1].FindFirstSet(index, levelBits);
+            if (found >= levelBits) return bitCount;
+            break;
+        }
+
+        found = FindInWord(level, index);
+        if (found < (index / 64 + 1) * 64) break;
+        index = index / 64 + 1;
+        level++;
+    }
+
+    // walk back down, each level pointing at a word that has something available
+    while (level > 0){
+        level--;
+        found = FindInWord(level, found * 64);
+    }
+
+    return found;
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "Bitmap.h"
+
+#define SUMMARY_MAX_LEVELS 5
+
+// Summary levels over a Bitmap so the first clear bit can be found in a few word reads.
+// Level 1 bit n is set while word n of the base still has a clear bit,
+// level k bit n is set while word n of level k - 1 is non-zero.
+class BitmapSummary {
+    public:
+    static size_t MetadataSize(uint64_t bitCount);
+    void Init(Bitmap* base, void* buffer);
+    void Update(uint64_t start, uint64_t count);
+    uint64_t FindFirstClear(uint64_t start);
+
+    private:
+    Bitmap* Base;
+    Bitmap Levels[SUMMARY_MAX_LEVELS];
+    uint8_t LevelCount;
+    Bitmap* LevelBitmap(uint8_t level);
+    uint64_t FindInWord(uint8_t level, uint64_t index);
+};
\ No newline at end of file
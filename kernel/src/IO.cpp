@@ -14,4 +14,20 @@ uint8_t inb(uint16_t port){
 
 void io_wait(){
     asm volatile ("outb %%al, $0x80" : : "a"(0));
-}
\ No newline at end of file
+}
+
+uint64_t DisableInterrupts(){
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void RestoreInterrupts(uint64_t flags){
+    if (flags & 0x200) asm volatile ("sti" : : : "memory"); // IF was set
+}
+
+bool InterruptsEnabled(){
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0" : "=r"(flags));
+    return flags & 0x200;
+}
@@ -3,4 +3,9 @@
 
 void outb (uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
-void io_wait();
\ No newline at end of file
+void io_wait();
+
+// Saves RFLAGS and clears IF; pass the result to RestoreInterrupts
+uint64_t DisableInterrupts();
+void RestoreInterrupts(uint64_t flags);
+bool InterruptsEnabled();
\ No newline at end of file
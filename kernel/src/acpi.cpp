@@ -1,4 +1,5 @@
 #include "acpi.h"
+#include "paging/DirectMap.h"
 
 namespace ACPI{
 
@@ -7,7 +8,7 @@ namespace ACPI{
         int entries = (sdtHeader->Length - sizeof(ACPI::SDTHeader)) / 8;
 
         for (int t = 0; t < entries; t++){
-            ACPI::SDTHeader* newSDTHeader = (ACPI::SDTHeader*)*(uint64_t*)((uint64_t)sdtHeader + sizeof(ACPI::SDTHeader) + (t * 8));
+            ACPI::SDTHeader* newSDTHeader = (ACPI::SDTHeader*)PhysicalToVirtual(*(uint64_t*)((uint64_t)sdtHeader + sizeof(ACPI::SDTHeader) + (t * 8)));
             for (int i = 0; i < 4; i++){
                 if (newSDTHeader->Signature[i] != signature[i])
                 {
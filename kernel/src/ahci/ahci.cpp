@@ -2,7 +2,10 @@
 #include "../BasicRenderer.h"
 #include "../paging/PageTableManager.h"
 #include "../memory/heap.h"
+#include "../memory/vmalloc.h"
+#include "../memory/slab.h"
 #include "../paging/PageFrameAllocator.h"
+#include "../paging/DirectMap.h"
 
 namespace AHCI{
 
@@ -18,6 +21,11 @@ namespace AHCI{
     #define HBA_PxCMD_ST 0x0001
     #define HBA_PxCMD_FR 0x4000
 
+    #define AHCI_DMA_LIMIT 0x100000000 // HBAs without S64A can only address the low 4 GiB
+    #define AHCI_FIS_OFFSET 0x400 // command list is 32 * 32 bytes
+    #define AHCI_CMD_TABLE_OFFSET 0x800 // 32 command tables of 256 bytes, 128 byte aligned
+    #define AHCI_PORT_DMA_PAGES 3
+
     PortType CheckPortType(HBAPort* port){
         uint32_t sataStatus = port->sataStatus;
 
@@ -41,14 +49,24 @@ namespace AHCI{
         }
     }
 
+    static SlabCache* PortCache;
+
+    static void ClearPort(void* port){
+        memset(port, 0, sizeof(Port));
+    }
+
     void AHCIDriver::ProbePorts(){
+        portCount = 0;
+        if (PortCache == NULL) PortCache = kmem_cache_create(sizeof(Port), SLAB_CACHE_LINE, ClearPort);
+        if (PortCache == NULL) return;
         uint32_t portsImplemented = ABAR->portsImplemented;
         for (int i = 0; i < 32; i++){
             if (portsImplemented & (1 << i)){
                 PortType portType = CheckPortType(&ABAR->ports[i]);
 
                 if (portType == PortType::SATA || portType == PortType::SATAPI){
-                    ports[portCount] = new Port();
+                    ports[portCount] = (Port*)kmem_cache_alloc(PortCache);
+                    if (ports[portCount] == NULL) return;
                     ports[portCount]->portType = portType;
                     ports[portCount]->hbaPort = &ABAR->ports[i];
                     ports[portCount]->portNumber = portCount;
@@ -58,32 +76,35 @@ namespace AHCI{
         }
     }
 
-    void Port::Configure(){
+    bool Port::Configure(){
         StopCMD();
 
-        void* newBase = GlobalAllocator.RequestPage();
+        // command list, received FIS area and all 32 command tables share one DMA region below 4 GiB
+        // the HBA gets physical addresses, the CPU goes through the direct map
+        uint8_t* dmaBase = (uint8_t*)GlobalAllocator.RequestContiguousPages(AHCI_PORT_DMA_PAGES, 0x1000, AHCI_DMA_LIMIT);
+        if (dmaBase == NULL) return false;
+        memset(PhysicalToVirtual(dmaBase), 0, AHCI_PORT_DMA_PAGES * 0x1000);
+
+        void* newBase = dmaBase;
         hbaPort->commandListBase = (uint32_t)(uint64_t)newBase;
         hbaPort->commandListBaseUpper = (uint32_t)((uint64_t)newBase >> 32);
-        memset((void*)(hbaPort->commandListBase), 0, 1024);
 
-        void* fisBase = GlobalAllocator.RequestPage();
+        void* fisBase = dmaBase + AHCI_FIS_OFFSET;
         hbaPort->fisBaseAddress = (uint32_t)(uint64_t)fisBase;
         hbaPort->fisBaseAddressUpper = (uint32_t)((uint64_t)fisBase >> 32);
-        memset(fisBase, 0, 256);
 
-        HBACommandHeader* cmdHeader = (HBACommandHeader*)((uint64_t)hbaPort->commandListBase + ((uint64_t)hbaPort->commandListBaseUpper << 32));
+        HBACommandHeader* cmdHeader = (HBACommandHeader*)PhysicalToVirtual(newBase);
 
         for (int i = 0; i < 32; i++){
             cmdHeader[i].prdtLength = 8;
 
-            void* cmdTableAddress = GlobalAllocator.RequestPage();
-            uint64_t address = (uint64_t)cmdTableAddress + (i << 8);
+            uint64_t address = (uint64_t)dmaBase + AHCI_CMD_TABLE_OFFSET + (i << 8);
             cmdHeader[i].commandTableBaseAddress = (uint32_t)(uint64_t)address;
             cmdHeader[i].commandTableBaseAddressUpper = (uint32_t)((uint64_t)address >> 32);
-            memset(cmdTableAddress, 0, 256);
         }
 
         StartCMD();
+        return true;
     }
 
     void Port::StopCMD(){
@@ -112,16 +133,17 @@ namespace AHCI{
 
         hbaPort->interruptStatus = (uint32_t)-1; // Clear pending interrupt bits
 
-        HBACommandHeader* cmdHeader = (HBACommandHeader*)hbaPort->commandListBase;
+        HBACommandHeader* cmdHeader = (HBACommandHeader*)PhysicalToVirtual(hbaPort->commandListBase | ((uint64_t)hbaPort->commandListBaseUpper << 32));
         cmdHeader->commandFISLength = sizeof(FIS_REG_H2D)/ sizeof(uint32_t); //command FIS size;
         cmdHeader->write = 0; //this is a read
         cmdHeader->prdtLength = 1;
 
-        HBACommandTable* commandTable = (HBACommandTable*)(cmdHeader->commandTableBaseAddress);
+        HBACommandTable* commandTable = (HBACommandTable*)PhysicalToVirtual(cmdHeader->commandTableBaseAddress | ((uint64_t)cmdHeader->commandTableBaseAddressUpper << 32));
         memset(commandTable, 0, sizeof(HBACommandTable) + (cmdHeader->prdtLength-1)*sizeof(HBAPRDTEntry));
 
-        commandTable->prdtEntry[0].dataBaseAddress = (uint32_t)(uint64_t)buffer;
-        commandTable->prdtEntry[0].dataBaseAddressUpper = (uint32_t)((uint64_t)buffer >> 32);
+        uint64_t bufferPhysical = VirtualToPhysical(buffer);
+        commandTable->prdtEntry[0].dataBaseAddress = (uint32_t)bufferPhysical;
+        commandTable->prdtEntry[0].dataBaseAddressUpper = (uint32_t)(bufferPhysical >> 32);
         commandTable->prdtEntry[0].byteCount = (sectorCount<<9)-1; // 512 bytes per sector
         commandTable->prdtEntry[0].interruptOnCompletion = 1;
 
@@ -171,17 +193,25 @@ namespace AHCI{
         GlobalRenderer->Print("AHCI Driver instance initialized");
         GlobalRenderer->Next();
 
-        ABAR = (HBAMemory*)((PCI::PCIHeader0*)pciBaseAddress)->BAR5;
-
-        g_PageTableManager.MapMemory(ABAR, ABAR);
+        uint64_t abarPhysical = ((PCI::PCIHeader0*)pciBaseAddress)->BAR5 & ~(uint64_t)0xf; // low bits are BAR flags
+        ABAR = (HBAMemory*)ioremap(abarPhysical, sizeof(HBAMemory), PAGE_MAP_UC);
+        if (ABAR == NULL) return;
         ProbePorts();
         
         for (int i = 0; i < portCount; i++){
             Port* port = ports[i];
 
-            port->Configure();
+            if (!port->Configure()) continue;
 
-            port->buffer = (uint8_t*)GlobalAllocator.RequestPage();
+            void* buffer = GlobalAllocator.RequestContiguousPages(1, 0x1000, AHCI_DMA_LIMIT);
+            if (buffer == NULL){
+                // stop the HBA using the command list before handing its region back
+                port->StopCMD();
+                void* dmaBase = (void*)(port->hbaPort->commandListBase | ((uint64_t)port->hbaPort->commandListBaseUpper << 32));
+                GlobalAllocator.FreeContiguousPages(dmaBase, AHCI_PORT_DMA_PAGES);
+                continue;
+            }
+            port->buffer = (uint8_t*)PhysicalToVirtual(buffer);
             memset(port->buffer, 0, 0x1000);
 
             port->Read(0, 4, port->buffer);
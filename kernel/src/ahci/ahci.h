@@ -141,7 +141,7 @@ namespace AHCI {
             PortType portType;
             uint8_t* buffer;
             uint8_t portNumber;
-            void Configure();
+            bool Configure();
             void StartCMD();
             void StopCMD();
             bool Read(uint64_t sector, uint32_t sectorCount, void* buffer);
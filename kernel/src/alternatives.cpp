@@ -0,0 +1,40 @@
+#include "alternatives.h"
+
+extern AltInstruction _AltInstructionsStart[];
+extern AltInstruction _AltInstructionsEnd[];
+
+// Recommended multi-byte NOPs, indexed by length
+static const uint8_t NOPs[9][9] = {
+    {},
+    {0x90},
+    {0x66, 0x90},
+    {0x0f, 0x1f, 0x00},
+    {0x0f, 0x1f, 0x40, 0x00},
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+static void FillNOPs(uint8_t* address, uint8_t length){
+    while (length > 0){
+        uint8_t chunk = length > 8 ? 8 : length;
+        for (uint8_t i = 0; i < chunk; i++) address[i] = NOPs[chunk][i];
+        address += chunk;
+        length -= chunk;
+    }
+}
+
+void ApplyAlternatives(){
+    for (AltInstruction* entry = _AltInstructionsStart; entry < _AltInstructionsEnd; entry++){
+        if (!CPUHasFeature(entry->feature)) continue;
+
+        uint8_t* original = (uint8_t*)&entry->originalOffset + entry->originalOffset;
+        uint8_t* replacement = (uint8_t*)&entry->replacementOffset + entry->replacementOffset;
+        for (uint8_t i = 0; i < entry->replacementLength; i++) original[i] = replacement[i];
+        FillNOPs(original + entry->replacementLength, entry->originalLength - entry->replacementLength);
+    }
+
+    // cpuid serialises, so no stale copy of the old instructions runs after this
+    cpuid(0);
+}
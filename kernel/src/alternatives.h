@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include "cpu.h"
+
+// One entry per patch site, in .altinstructions (kernel.ld). Offsets are relative to the
+// field holding them, so the table needs no relocation.
+struct AltInstruction {
+    int32_t originalOffset;
+    int32_t replacementOffset;
+    uint16_t feature; // CPU_FEATURE_*
+    uint8_t originalLength;
+    uint8_t replacementLength;
+} __attribute__((packed));
+
+// Assembles original in place, padded with NOPs to the longer of the two, and keeps
+// replacement in .altinstr_replacement. ApplyAlternatives copies replacement over original
+// when the CPU has feature (an asm operand such as "%c[feature]"). The replacement is
+// copied byte for byte, so it must not contain relative jumps or calls.
+#define ALTERNATIVE(original, replacement, feature) \
+    "661:\n\t" original "\n662:\n\t" \
+    ".skip -(((665f - 664f) - (662b - 661b)) > 0) * ((665f - 664f) - (662b - 661b)), 0x90\n663:\n\t" \
+    ".pushsection .altinstructions, \"a\"\n\t" \
+    ".long 661b - .\n\t" \
+    ".long 664f - .\n\t" \
+    ".word " feature "\n\t" \
+    ".byte 663b - 661b\n\t" \
+    ".byte 665f - 664f\n\t" \
+    ".popsection\n\t" \
+    ".pushsection .altinstr_replacement, \"ax\"\n664:\n\t" replacement "\n665:\n\t" \
+    ".popsection\n\t"
+
+// Patches every site whose feature the CPU has. Runs once, after DetectCPUFeatures.
+void ApplyAlternatives();
+
+// A feature test without a branch on a variable: a jump to the false path that is patched
+// into NOPs on CPUs with the feature
+template <uint16_t Feature>
+__attribute__((always_inline)) inline bool CPUHas(){
+    asm goto (ALTERNATIVE("jmp %l[missing]", "", "%c[feature]") : : [feature] "i"(Feature) : : missing);
+    return true;
+missing:
+    return false;
+}
+
+// Serialising timestamp read: lfence + rdtsc, or rdtscp where the CPU has it
+__attribute__((always_inline)) inline uint64_t ReadTSC(){
+    uint32_t low;
+    uint32_t high;
+    asm volatile (ALTERNATIVE("lfence\n\trdtsc", "rdtscp", "%c[feature]")
+        : "=a"(low), "=d"(high) : [feature] "i"(CPU_FEATURE_RDTSCP) : "rcx");
+    return ((uint64_t)high << 32) | low;
+}
@@ -0,0 +1,139 @@
+#include "cpu.h"
+
+CPUIDResult cpuid(uint32_t leaf, uint32_t subleaf){
+    CPUIDResult result;
+    asm volatile ("cpuid"
+    : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+    : "a"(leaf), "c"(subleaf));
+    return result;
+}
+
+static uint64_t CPUFeatures; // bit per CPU_FEATURE_*
+
+void DetectCPUFeatures(){
+    CPUFeatures = 0;
+    if (CPUSupportsERMS()) CPUFeatures |= 1ULL << CPU_FEATURE_ERMS;
+    if (CPUSupportsFSRM()) CPUFeatures |= 1ULL << CPU_FEATURE_FSRM;
+    if (CPUSupportsAVX2()) CPUFeatures |= 1ULL << CPU_FEATURE_AVX2;
+    if (CPUSupportsXSAVEOPT()) CPUFeatures |= 1ULL << CPU_FEATURE_XSAVEOPT;
+    if (CPUSupportsPGE()) CPUFeatures |= 1ULL << CPU_FEATURE_PGE;
+    if (CPUSupportsPCID()) CPUFeatures |= 1ULL << CPU_FEATURE_PCID;
+    if (CPUSupportsINVPCID()) CPUFeatures |= 1ULL << CPU_FEATURE_INVPCID;
+    if (CPUSupportsRDTSCP()) CPUFeatures |= 1ULL << CPU_FEATURE_RDTSCP;
+}
+
+bool CPUHasFeature(uint16_t feature){
+    if (feature >= 64) return false;
+    return CPUFeatures & (1ULL << feature);
+}
+
+bool CPUSupports1GiBPages(){
+    if (cpuid(0x80000000).eax < 0x80000001) return false;
+    return cpuid(0x80000001).edx & (1 << 26); // Page1GB
+}
+
+
+bool CPUSupportsPAT(){
+    return cpuid(1).edx & (1 << 16);
+}
+
+bool CPUSupportsPGE(){
+    return cpuid(1).edx & (1 << 13);
+}
+
+bool CPUSupportsPCID(){
+    return cpuid(1).ecx & (1 << 17);
+}
+
+static inline bool HasLeaf7(){
+    return cpuid(0).eax >= 7;
+}
+
+bool CPUSupportsERMS(){
+    return HasLeaf7() && (cpuid(7).ebx & (1 << 9)); // enhanced rep movsb/stosb
+}
+
+bool CPUSupportsFSRM(){
+    return HasLeaf7() && (cpuid(7).edx & (1 << 4)); // fast short rep movsb
+}
+
+// AVX2 is only usable once the OS has enabled the YMM state in XCR0
+bool CPUSupportsAVX2(){
+    if (!HasLeaf7() || !(cpuid(7).ebx & (1 << 5))) return false;
+    if (!(ReadCR4() & CR4_OSXSAVE)) return false;
+    return (ReadXCR0() & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX);
+}
+
+bool CPUSupportsXSAVE(){
+    return cpuid(1).ecx & (1 << 26);
+}
+
+bool CPUSupportsXSAVEOPT(){
+    if (cpuid(0).eax < 0xD) return false;
+    return cpuid(0xD, 1).eax & (1 << 0);
+}
+
+bool CPUSupportsAVX(){
+    return cpuid(1).ecx & (1 << 28);
+}
+
+bool CPUSupportsINVPCID(){
+    return HasLeaf7() && (cpuid(7).ebx & (1 << 10));
+}
+
+bool CPUSupportsRDTSCP(){
+    if (cpuid(0x80000000).eax < 0x80000001) return false;
+    return cpuid(0x80000001).edx & (1 << 27);
+}
+
+uint64_t ReadMSR(uint32_t msr){
+    uint32_t low;
+    uint32_t high;
+    asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void WriteMSR(uint32_t msr, uint64_t value){
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+uint64_t ReadCR0(){
+    uint64_t value;
+    asm volatile ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+void WriteCR0(uint64_t value){
+    asm volatile ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+uint64_t ReadCR3(){
+    uint64_t value;
+    asm volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+void WriteCR3(uint64_t value){
+    asm volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+uint64_t ReadCR4(){
+    uint64_t value;
+    asm volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+void WriteCR4(uint64_t value){
+    asm volatile ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+uint64_t ReadXCR0(){
+    uint32_t low;
+    uint32_t high;
+    asm volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((uint64_t)high << 32) | low;
+}
+
+void WriteXCR0(uint64_t value){
+    asm volatile ("xsetbv" : : "c"(0), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
\ No newline at end of file
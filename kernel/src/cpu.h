@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+
+struct CPUIDResult {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+#define MSR_IA32_PAT 0x277
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_PCIDE (1 << 17)
+#define CR4_OSXSAVE (1 << 18)
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+// Feature numbers for CPUHasFeature and the alternatives table (alternatives.h). Plain
+// numbers, since they end up in assembler directives.
+#define CPU_FEATURE_ERMS 0
+#define CPU_FEATURE_FSRM 1
+#define CPU_FEATURE_AVX2 2 // usable: needs the YMM state enabled, so detect after InitializeFPU
+#define CPU_FEATURE_XSAVEOPT 3
+#define CPU_FEATURE_PGE 4
+#define CPU_FEATURE_PCID 5
+#define CPU_FEATURE_INVPCID 6
+#define CPU_FEATURE_RDTSCP 7
+
+CPUIDResult cpuid(uint32_t leaf, uint32_t subleaf = 0);
+void DetectCPUFeatures();
+bool CPUHasFeature(uint16_t feature);
+bool CPUSupports1GiBPages();
+bool CPUSupportsPAT();
+bool CPUSupportsPGE();
+bool CPUSupportsPCID();
+bool CPUSupportsERMS();
+bool CPUSupportsFSRM();
+bool CPUSupportsAVX2();
+bool CPUSupportsXSAVE();
+bool CPUSupportsXSAVEOPT();
+bool CPUSupportsAVX();
+bool CPUSupportsINVPCID();
+bool CPUSupportsRDTSCP();
+
+uint64_t ReadMSR(uint32_t msr);
+void WriteMSR(uint32_t msr, uint64_t value);
+
+uint64_t ReadCR0();
+void WriteCR0(uint64_t value);
+uint64_t ReadCR3();
+void WriteCR3(uint64_t value);
+uint64_t ReadCR4();
+void WriteCR4(uint64_t value);
+uint64_t ReadXCR0();
+void WriteXCR0(uint64_t value);
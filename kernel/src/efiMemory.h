@@ -9,4 +9,18 @@ struct EFI_MEMORY_DESCRIPTOR {
     uint64_t attribs;
 };
 
-extern const char* EFI_MEMORY_TYPE_STRINGS[];
\ No newline at end of file
+extern const char* EFI_MEMORY_TYPE_STRINGS[];
+
+// Descriptor types backed by RAM: everything but reserved, unusable, MMIO and PAL code
+inline bool IsRAMMemoryType(uint32_t type){
+    switch (type){
+        case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 9: case 10:
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline bool IsMMIOMemoryType(uint32_t type){
+    return type == 11 || type == 12; // EfiMemoryMappedIO, EfiMemoryMappedIOPortSpace
+}
\ No newline at end of file
@@ -16,6 +16,11 @@ _kernel_entry:
     
     ; Disable interrupts immediately
     cli
+
+    ; Move off the firmware stack - it lives in boot services memory
+    ; that the kernel hands back to the page allocator later on
+    mov rsp, kernel_stack_top
+    xor rbp, rbp
     
     ; Save bootInfo pointer
     push rdi
@@ -45,3 +50,9 @@ _kernel_entry:
     cli
     hlt
     jmp $
+
+section .bss
+align 16
+kernel_stack_bottom:
+    resb 0x10000
+kernel_stack_top:
@@ -0,0 +1,77 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "IO.h"
+#include "panic.h"
+
+static FPUSaveMode SaveMode = FPUSaveMode::FPUSaveFXSAVE;
+static uint64_t SaveMask; // XCR0, the components XSAVE covers
+static uint64_t Depth;
+static uint8_t SaveAreas[FPU_MAX_DEPTH][FPU_SAVE_AREA_SIZE] __attribute__((aligned(64)));
+
+void InitializeFPU(){
+    uint64_t cr0 = ReadCR0();
+    cr0 &= ~(uint64_t)(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    WriteCR0(cr0);
+
+    uint64_t cr4 = ReadCR4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (CPUSupportsXSAVE()) cr4 |= CR4_OSXSAVE;
+    WriteCR4(cr4);
+
+    uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+    asm volatile ("fninit\n\tldmxcsr %0" : : "m"(mxcsr));
+
+    if (!(cr4 & CR4_OSXSAVE)) return;
+
+    SaveMask = XCR0_X87 | XCR0_SSE;
+    if (CPUSupportsAVX()) SaveMask |= XCR0_AVX;
+    WriteXCR0(SaveMask);
+
+    // the size for the enabled components; anything bigger than a slot falls back to FXSAVE
+    if (cpuid(0xD).ebx > FPU_SAVE_AREA_SIZE){
+        SaveMask &= ~(uint64_t)XCR0_AVX;
+        WriteXCR0(SaveMask);
+        return;
+    }
+    SaveMode = CPUSupportsXSAVEOPT() ? FPUSaveMode::FPUSaveXSAVEOPT : FPUSaveMode::FPUSaveXSAVE;
+}
+
+FPUSaveMode GetFPUSaveMode(){
+    return SaveMode;
+}
+
+void KernelFPUBegin(){
+    uint64_t flags = DisableInterrupts();
+    if (Depth >= FPU_MAX_DEPTH) Panic("Kernel FPU sections nested too deeply");
+    uint8_t* area = SaveAreas[Depth++];
+
+    uint32_t low = (uint32_t)SaveMask;
+    uint32_t high = (uint32_t)(SaveMask >> 32);
+    switch (SaveMode){
+        case FPUSaveMode::FPUSaveXSAVEOPT:
+            asm volatile ("xsaveopt64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUSaveMode::FPUSaveXSAVE:
+            asm volatile ("xsave64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUSaveMode::FPUSaveFXSAVE:
+            asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+            break;
+    }
+
+    // the section starts from a clean x87/SSE state
+    uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+    asm volatile ("fninit\n\tldmxcsr %0" : : "m"(mxcsr));
+    RestoreInterrupts(flags);
+}
+
+void KernelFPUEnd(){
+    uint64_t flags = DisableInterrupts();
+    uint8_t* area = SaveAreas[--Depth];
+
+    uint32_t low = (uint32_t)SaveMask;
+    uint32_t high = (uint32_t)(SaveMask >> 32);
+    if (SaveMode == FPUSaveMode::FPUSaveFXSAVE) asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+    else asm volatile ("xrstor64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+    RestoreInterrupts(flags);
+}
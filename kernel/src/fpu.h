@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+#define FPU_MAX_DEPTH 4 // nested sections: an IRQ, a page fault taken inside it, ...
+#define FPU_SAVE_AREA_SIZE 1024 // x87, SSE and AVX state take 832 bytes in the XSAVE layout
+#define FPU_DEFAULT_MXCSR 0x1f80 // all SIMD exceptions masked, round to nearest
+
+enum FPUSaveMode {
+    FPUSaveFXSAVE = 0,
+    FPUSaveXSAVE = 1,
+    FPUSaveXSAVEOPT = 2, // skips components that were not modified since the last restore
+};
+
+// Turns on x87, SSE and, where the CPU has XSAVE and AVX, the AVX state
+void InitializeFPU();
+FPUSaveMode GetFPUSaveMode();
+
+// Kernel code owns the SIMD registers outside of interrupts. An interrupt or exception
+// handler that calls into code which may use them (memset, the renderer, ...) wraps the
+// call in a section, which saves the interrupted state and puts it back at the end.
+void KernelFPUBegin();
+void KernelFPUEnd();
@@ -4,12 +4,21 @@
 #include "../userinput/keyboard.h"
 #include "../scheduling/pit/pit.h"
 #include "../cstr.h"
+#include "../paging/AddressSpace.h"
+#include "../fpu.h"
+#include "../BasicRenderer.h"
 
-__attribute__((interrupt)) void PageFault_Handler(interrupt_frame* frame){
-    // Page faults have an error code - try to read CR2 for faulting address
+__attribute__((interrupt)) void PageFault_Handler(interrupt_frame* frame, uint64_t errorCode){
+    // CR2 holds the faulting address
     uint64_t faulting_addr;
-    asm ("mov %%cr2, %0" : "=r" (faulting_addr));
-    
+    asm volatile ("mov %%cr2, %0" : "=r" (faulting_addr));
+
+    // first touch of a lazily backed area such as the heap; zeroing the new page may use SIMD
+    KernelFPUBegin();
+    bool handled = HandleMemoryFault(faulting_addr, errorCode);
+    KernelFPUEnd();
+    if (handled) return;
+
     Panic("Page Fault - Check memory mapping and paging tables");
     while(true) asm("hlt");
 }
@@ -29,7 +38,9 @@ __attribute__((interrupt)) void GPFault_Handler(interrupt_frame* frame){
 __attribute__((interrupt)) void KeyboardInt_Handler(interrupt_frame* frame){
     uint8_t scancode = inb(0x60);
 
+    KernelFPUBegin();
     HandleKeyboard(scancode);
+    KernelFPUEnd();
 
     PIC_EndMaster();
 }
@@ -38,13 +49,19 @@ __attribute__((interrupt)) void MouseInt_Handler(interrupt_frame* frame){
 
     uint8_t mouseData = inb(0x60);
 
+    KernelFPUBegin();
     HandlePS2Mouse(mouseData);
+    KernelFPUEnd();
 
     PIC_EndSlave();
 }
 
 __attribute__((interrupt)) void PITInt_Handler(interrupt_frame* frame){
+    // Tick keeps time in a double, so it needs the section as much as Flush does
+    KernelFPUBegin();
     PIT::Tick();
+    if (GlobalRenderer->FlushOnTick) GlobalRenderer->Flush();
+    KernelFPUEnd();
     PIC_EndMaster();
 }
 
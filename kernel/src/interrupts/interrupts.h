@@ -13,7 +13,7 @@
 #define ICW4_8086 0x01
 
 struct interrupt_frame;
-__attribute__((interrupt)) void PageFault_Handler(interrupt_frame* frame);
+__attribute__((interrupt)) void PageFault_Handler(interrupt_frame* frame, uint64_t errorCode);
 __attribute__((interrupt)) void DoubleFault_Handler(interrupt_frame* frame);
 __attribute__((interrupt)) void GPFault_Handler(interrupt_frame* frame);
 __attribute__((interrupt)) void KeyboardInt_Handler(interrupt_frame* frame);
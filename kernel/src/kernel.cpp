@@ -2,10 +2,12 @@
 #include "memory/heap.h"
 #include "scheduling/pit/pit.h"
 #include "printf.h"
+#include "memory/memops.h"
 
 extern "C" void _start(BootInfo* bootInfo){
 
     KernelInfo kernelInfo = InitializeKernel(bootInfo);
+    bootInfo = kernelInfo.bootInfo; // the loader's BootInfo has been reclaimed
     
     // Print kernel information
     kernel_printf("\n");
@@ -60,11 +62,19 @@ extern "C" void _start(BootInfo* bootInfo){
     }
     kernel_printf("\n");
     
+#ifdef MEMORY_BENCHMARK // make CFLAGS+=-DMEMORY_BENCHMARK
+    BenchmarkMemoryRoutines();
+    kernel_printf("\n");
+#endif
+
     kernel_printf("========================================\n");
     kernel_printf("=== System Ready ===\n");
     kernel_printf("========================================\n");
 
+    // idle: keep the zeroed page pool topped up and give freed heap pages back, sleep once there is nothing left to do
     while(true){
+        if (GlobalAllocator.RefillZeroedPool()) continue;
+        if (TrimHeap() > 0) continue;
         asm ("hlt");
     }
 
@@ -4,7 +4,14 @@
 #include "interrupts/interrupts.h"
 #include "IO.h"
 #include "memory/heap.h"
+#include "memory/vmalloc.h"
+#include "memory/memops.h"
+#include "fpu.h"
+#include "alternatives.h"
 #include "printf.h"
+#include "paging/DirectMap.h"
+#include "paging/TLB.h"
+#include "paging/AddressSpace.h"
 
 KernelInfo kernelInfo; 
 
@@ -12,30 +19,53 @@ void PrepareMemory(BootInfo* bootInfo){
     uint64_t mMapEntries = bootInfo->mMapSize / bootInfo->mMapDescSize;
 
     GlobalAllocator = PageFrameAllocator();
+    GlobalAllocator.Backend = PageFrameBackend::BuddyBackend;
     GlobalAllocator.ReadEFIMemoryMap(bootInfo->mMap, bootInfo->mMapSize, bootInfo->mMapDescSize);
 
     uint64_t kernelSize = (uint64_t)&_KernelEnd - (uint64_t)&_KernelStart;
     uint64_t kernelPages = (uint64_t)kernelSize / 4096 + 1;
 
-    GlobalAllocator.LockPages(&_KernelStart, kernelPages);
+    GlobalAllocator.LockPages((void*)VirtualToPhysical(&_KernelStart), kernelPages);
 
-    PageTable* PML4 = (PageTable*)GlobalAllocator.RequestPage();
-    memset(PML4, 0, 0x1000);
+    ConfigurePAT();
+
+    PageTable* PML4 = (PageTable*)PhysicalToVirtual(GlobalAllocator.RequestZeroedPage());
 
     g_PageTableManager = PageTableManager(PML4);
 
-    for (uint64_t t = 0; t < GetMemorySize(bootInfo->mMap, mMapEntries, bootInfo->mMapDescSize); t+= 0x1000){
-        g_PageTableManager.MapMemory((void*)t, (void*)t);
+    // direct map what the firmware described, skipping holes and MMIO ranges. Adjacent
+    // descriptors are merged first so the runs can use large pages across descriptor edges.
+    // Nothing is mapped in the lower half.
+    uint64_t runStart = 0;
+    uint64_t runEnd = 0;
+    for (uint64_t i = 0; i <= mMapEntries; i++){
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)bootInfo->mMap + (i * bootInfo->mMapDescSize));
+        if (i < mMapEntries){
+            if (IsMMIOMemoryType(desc->type)) continue;
+            if ((uint64_t)desc->physAddr == runEnd){
+                runEnd += desc->numPages * 0x1000;
+                continue;
+            }
+        }
+        if (runEnd > runStart){
+            g_PageTableManager.MapRange(PhysicalToVirtual(runStart), (void*)runStart, (runEnd - runStart) / 0x1000);
+        }
+        if (i < mMapEntries){
+            runStart = (uint64_t)desc->physAddr;
+            runEnd = runStart + desc->numPages * 0x1000;
+        }
     }
 
-    uint64_t fbBase = (uint64_t)bootInfo->framebuffer->BaseAddress;
+    g_PageTableManager.MapRange(&_KernelStart, (void*)VirtualToPhysical(&_KernelStart), kernelPages);
+
+    uint64_t fbBase = VirtualToPhysical(bootInfo->framebuffer->BaseAddress);
     uint64_t fbSize = (uint64_t)bootInfo->framebuffer->BufferSize + 0x1000;
     GlobalAllocator.LockPages((void*)fbBase, fbSize/ 0x1000 + 1);
-    for (uint64_t t = fbBase; t < fbBase + fbSize; t += 4096){
-        g_PageTableManager.MapMemory((void*)t, (void*)t);
-    }
+    g_PageTableManager.MapRange(PhysicalToVirtual(fbBase), (void*)fbBase, fbSize / 0x1000 + 1, PageMapWrite | PAGE_MAP_WC);
 
-    asm ("mov %0, %%cr3" : : "r" (PML4));
+    g_PageTableManager.Activate();
+    EnableTLBFeatures();
+    KernelAddressSpace.InitKernel(&g_PageTableManager);
 
     kernelInfo.pageTableManager = &g_PageTableManager;
 }
@@ -51,7 +81,7 @@ void SetIDTGate(void* handler, uint8_t entryOffset, uint8_t type_attr, uint8_t s
 
 void PrepareInterrupts(){
     idtr.Limit = 0x0FFF;
-    idtr.Offset = (uint64_t)GlobalAllocator.RequestPage();
+    idtr.Offset = (uint64_t)PhysicalToVirtual(GlobalAllocator.RequestPage());
 
     SetIDTGate((void*)PageFault_Handler, 0xE, IDT_TA_InterruptGate, 0x08);
     SetIDTGate((void*)DoubleFault_Handler, 0x8, IDT_TA_InterruptGate, 0x08);
@@ -77,13 +107,12 @@ void PrepareACPI(BootInfo* bootInfo){
     kernel_printf("    - OEM: %.6s\n", (char*)bootInfo->rsdp->OEMId);
     kernel_printf("    - Revision: %u\n", bootInfo->rsdp->Revision);
     
-    ACPI::SDTHeader* xsdt = (ACPI::SDTHeader*)(bootInfo->rsdp->XSDTAddress);
-    
-    if (xsdt == NULL){
+    if (bootInfo->rsdp->XSDTAddress == 0){
         kernel_printf("  [ACPI] WARNING: XSDT is NULL at 0x%p, skipping PCI enumeration\n", bootInfo->rsdp->XSDTAddress);
         return;
     }
 
+    ACPI::SDTHeader* xsdt = (ACPI::SDTHeader*)PhysicalToVirtual(bootInfo->rsdp->XSDTAddress);
     kernel_printf("  [ACPI] XSDT found at 0x%p\n", xsdt);
     kernel_printf("    - Signature: %.4s\n", (char*)xsdt->Signature);
     kernel_printf("    - Length: %u bytes\n", xsdt->Length);
@@ -100,10 +129,65 @@ void PrepareACPI(BootInfo* bootInfo){
     }
 }
 
+BootInfo kernelBootInfo;
+Framebuffer kernelFramebuffer;
+
+// Copies everything the kernel still uses out of loader-owned memory, then returns
+// EfiLoader* and EfiBootServices* regions to the page allocator
+void ReclaimBootMemory(BootInfo* bootInfo){
+    kernelBootInfo = *bootInfo;
+
+    kernelFramebuffer = *bootInfo->framebuffer;
+    kernelBootInfo.framebuffer = &kernelFramebuffer;
+
+    if (bootInfo->psf1_Font != NULL){
+        PSF1_HEADER* header = bootInfo->psf1_Font->psf1_Header;
+        uint64_t glyphBufferSize = header->charsize * 256;
+        if (header->mode == 1) glyphBufferSize = header->charsize * 512; // 512 glyph mode
+
+        PSF1_FONT* font = (PSF1_FONT*)malloc(sizeof(PSF1_FONT) + sizeof(PSF1_HEADER) + glyphBufferSize);
+        font->psf1_Header = (PSF1_HEADER*)((uint64_t)font + sizeof(PSF1_FONT));
+        font->glyphBuffer = (void*)((uint64_t)font->psf1_Header + sizeof(PSF1_HEADER));
+        memcpy(font->psf1_Header, header, sizeof(PSF1_HEADER));
+        memcpy(font->glyphBuffer, bootInfo->psf1_Font->glyphBuffer, glyphBufferSize);
+        kernelBootInfo.psf1_Font = font;
+    }
+
+    kernelBootInfo.mMap = (EFI_MEMORY_DESCRIPTOR*)malloc(bootInfo->mMapSize);
+    memcpy(kernelBootInfo.mMap, bootInfo->mMap, bootInfo->mMapSize);
+
+    GlobalRenderer->TargetFramebuffer = kernelBootInfo.framebuffer;
+    GlobalRenderer->PSF1_Font = kernelBootInfo.psf1_Font;
+    kernelInfo.bootInfo = &kernelBootInfo;
+
+    uint64_t kernelSize = (uint64_t)&_KernelEnd - (uint64_t)&_KernelStart;
+    uint64_t kernelPages = (uint64_t)kernelSize / 4096 + 1;
+    uint64_t reclaimed = GlobalAllocator.ReclaimBootMemory(kernelBootInfo.mMap, kernelBootInfo.mMapSize, kernelBootInfo.mMapDescSize, (void*)VirtualToPhysical(&_KernelStart), kernelPages);
+    kernel_printf("  [MEM] Reclaimed %u KiB of loader and boot services memory\n", (unsigned int)(reclaimed / 1024));
+}
+
+// The loader hands over physical pointers. Its page tables already carry the direct map,
+// so switch everything over to that before the lower half goes away in PrepareMemory.
+static BootInfo* RelocateBootInfo(BootInfo* bootInfo){
+    bootInfo = (BootInfo*)PhysicalToVirtual(bootInfo);
+    bootInfo->framebuffer = (Framebuffer*)PhysicalToVirtual(bootInfo->framebuffer);
+    bootInfo->framebuffer->BaseAddress = PhysicalToVirtual(bootInfo->framebuffer->BaseAddress);
+    if (bootInfo->psf1_Font != NULL){
+        bootInfo->psf1_Font = (PSF1_FONT*)PhysicalToVirtual(bootInfo->psf1_Font);
+        bootInfo->psf1_Font->psf1_Header = (PSF1_HEADER*)PhysicalToVirtual(bootInfo->psf1_Font->psf1_Header);
+        bootInfo->psf1_Font->glyphBuffer = PhysicalToVirtual(bootInfo->psf1_Font->glyphBuffer);
+    }
+    bootInfo->mMap = (EFI_MEMORY_DESCRIPTOR*)PhysicalToVirtual(bootInfo->mMap);
+    if (bootInfo->rsdp != NULL) bootInfo->rsdp = (ACPI::RSDP2*)PhysicalToVirtual(bootInfo->rsdp);
+    return bootInfo;
+}
+
 BasicRenderer r = BasicRenderer(NULL, NULL);
 KernelInfo InitializeKernel(BootInfo* bootInfo){
     // Disable interrupts during kernel initialization
     asm ("cli");
+
+    bootInfo = RelocateBootInfo(bootInfo);
     
     // Initialize renderer first for debug output
     r = BasicRenderer(bootInfo->framebuffer, bootInfo->psf1_Font);
@@ -128,6 +212,13 @@ KernelInfo InitializeKernel(BootInfo* bootInfo){
     };
     InitSerial();
 
+    // SSE/AVX state first, since usable AVX depends on it, then the CPU features, the
+    // alternatives patched for them, and the memset/memcpy variant before the memory setup leans on it
+    InitializeFPU();
+    DetectCPUFeatures();
+    ApplyAlternatives();
+    InitializeMemoryRoutines();
+
     GlobalRenderer->Print("Kernel Initialization Starting...");
     GlobalRenderer->Next();
 
@@ -150,7 +241,12 @@ KernelInfo InitializeKernel(BootInfo* bootInfo){
     // Initialize heap
     GlobalRenderer->Print("[*] Initializing heap...");
     GlobalRenderer->Next();
-    InitializeHeap((void*)0x0000100000000000, 0x10);
+    InitializeHeap((void*)HEAP_BASE, 0x10);
+    SetHeapLargePages(true);
+    if (InitializeVmalloc()){
+        if (GlobalRenderer->EnableBackBuffer()) GlobalRenderer->FlushOnTick = true;
+        GlobalRenderer->EnableScrollback();
+    }
 
     // Setup interrupt handlers
     GlobalRenderer->Print("[*] Setting up interrupts...");
@@ -173,6 +269,11 @@ KernelInfo InitializeKernel(BootInfo* bootInfo){
     outb(PIC1_DATA, 0b11111000);
     outb(PIC2_DATA, 0b11101111);
 
+    // Nothing below needs the loader's structures any more
+    GlobalRenderer->Print("[*] Reclaiming boot memory...");
+    GlobalRenderer->Next();
+    ReclaimBootMemory(bootInfo);
+
     GlobalRenderer->Print("[*] Enabling interrupts...");
     GlobalRenderer->Next();
     
@@ -28,6 +28,7 @@ extern uint64_t _KernelEnd;
 
 struct KernelInfo {
     PageTableManager* pageTableManager;
+    BootInfo* bootInfo; // kernel-owned copy, the loader's one is reclaimed during init
 };
 
 KernelInfo InitializeKernel(BootInfo* BootInfo);
\ No newline at end of file
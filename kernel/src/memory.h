@@ -1,7 +1,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include "efiMemory.h"
 
 uint64_t GetMemorySize(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize);
-void memset(void* start, uint8_t value, uint64_t num);
\ No newline at end of file
+
+// CPU dependent implementations in memory/memops.cpp
+void* memset(void* start, int value, size_t num);
+void* memcpy(void* destination, const void* source, size_t num);
+void* memmove(void* destination, const void* source, size_t num);
+int memcmp(const void* a, const void* b, size_t num);
\ No newline at end of file
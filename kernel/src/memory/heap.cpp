@@ -1,18 +1,117 @@
 #include "heap.h"
 #include "../paging/PageTableManager.h"
 #include "../paging/PageFrameAllocator.h"
+#include "../paging/AddressSpace.h"
 
 void* heapStart;
 void* heapEnd;
 HeapSegHdr* LastHdr;
 
-void InitializeHeap(void* heapAddress, size_t pageCount){
-    void* pos = heapAddress;
+static bool LargePages; // grow in 2 MiB arenas backed by 2 MiB pages
+static size_t FreedSinceTrim;
+
+static uint64_t FirstLevelMap; // bit per first level with any free segment
+static uint32_t SecondLevelMap[HEAP_FL_COUNT]; // bit per second level class with a free segment
+static HeapSegHdr* FreeLists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+static inline uint64_t HighestBit(size_t value){
+    return 63 - __builtin_clzll(value);
+}
+
+static inline void MapLength(size_t length, uint64_t* fl, uint64_t* sl){
+    if (length < HEAP_SMALL_LENGTH){
+        *fl = 0;
+        *sl = length / (HEAP_SMALL_LENGTH / HEAP_SL_COUNT);
+        return;
+    }
+    uint64_t bit = HighestBit(length);
+    *fl = bit - (HEAP_FL_SHIFT - 1);
+    *sl = (length >> (bit - HEAP_SL_SHIFT)) ^ HEAP_SL_COUNT;
+}
+
+static void InsertFree(HeapSegHdr* segment){
+    uint64_t fl, sl;
+    MapLength(segment->length, &fl, &sl);
+
+    segment->trimmed = false;
+    segment->lastFree = NULL;
+    segment->nextFree = FreeLists[fl][sl];
+    if (segment->nextFree != NULL) segment->nextFree->lastFree = segment;
+    FreeLists[fl][sl] = segment;
+    FirstLevelMap |= (uint64_t)1 << fl;
+    SecondLevelMap[fl] |= (uint32_t)1 << sl;
+}
+
+static void RemoveFree(HeapSegHdr* segment){
+    uint64_t fl, sl;
+    MapLength(segment->length, &fl, &sl);
+
+    if (segment->lastFree != NULL) segment->lastFree->nextFree = segment->nextFree;
+    else FreeLists[fl][sl] = segment->nextFree;
+    if (segment->nextFree != NULL) segment->nextFree->lastFree = segment->lastFree;
+
+    if (FreeLists[fl][sl] == NULL){
+        SecondLevelMap[fl] &= ~((uint32_t)1 << sl);
+        if (SecondLevelMap[fl] == 0) FirstLevelMap &= ~((uint64_t)1 << fl);
+    }
+}
+
+// First segment of a class at least as big as length's, rounding length up to the next class
+// boundary so that any segment found fits without walking its list
+static HeapSegHdr* FindFree(size_t length){
+    if (length >= HEAP_SMALL_LENGTH) length += ((size_t)1 << (HighestBit(length) - HEAP_SL_SHIFT)) - 1;
+
+    uint64_t fl, sl;
+    MapLength(length, &fl, &sl);
+    if (fl >= HEAP_FL_COUNT) return NULL;
+
+    uint32_t slMap = SecondLevelMap[fl] & (~(uint32_t)0 << sl);
+    if (slMap == 0){
+        uint64_t flMap = FirstLevelMap & (~(uint64_t)0 << (fl + 1));
+        if (flMap == 0) return NULL;
+        fl = __builtin_ctzll(flMap);
+        slMap = SecondLevelMap[fl];
+    }
+    sl = __builtin_ctz(slMap);
+    return FreeLists[fl][sl];
+}
+
+// Merges a free segment with its free neighbours, taking them off their lists first
+static HeapSegHdr* Coalesce(HeapSegHdr* segment){
+    if (segment->next != NULL && segment->next->free){
+        RemoveFree(segment->next);
+        segment->CombineForward();
+    }
+    if (segment->last != NULL && segment->last->free){
+        RemoveFree(segment->last);
+        segment->CombineBackward();
+        segment = segment->last;
+    }
+    return segment;
+}
+
+// Backs the range with the largest buddy blocks available so each block is one MapRange call
+static void MapHeapPages(void* address, size_t pageCount){
+    while (pageCount > 0){
+        uint8_t order = 0;
+        while (order < BUDDY_MAX_ORDER && ((size_t)2 << order) <= pageCount) order++;
 
-    for (size_t i = 0; i < pageCount; i++){
-        g_PageTableManager.MapMemory(pos, GlobalAllocator.RequestPage());
-        pos = (void*)((size_t)pos + 0x1000);
+        void* frames = GlobalAllocator.RequestPages(order);
+        while (frames == NULL && order > 0) frames = GlobalAllocator.RequestPages(--order);
+        if (frames == NULL) return;
+
+        size_t blockPages = (size_t)1 << order;
+        g_PageTableManager.MapRange(address, frames, blockPages);
+        address = (void*)((size_t)address + blockPages * 0x1000);
+        pageCount -= blockPages;
     }
+}
+
+// The whole window becomes an anonymous area of the kernel address space; only the first
+// pageCount pages are backed up front, since the heap is set up before the page fault handler
+// is installed and the area itself is allocated from the heap
+void InitializeHeap(void* heapAddress, size_t pageCount){
+    MapHeapPages(heapAddress, pageCount);
 
     size_t heapLength = pageCount * 0x1000;
 
@@ -24,13 +123,17 @@ void InitializeHeap(void* heapAddress, size_t pageCount){
     startSeg->last = NULL;
     startSeg->free = true;
     LastHdr = startSeg;
+    InsertFree(startSeg);
+
+    KernelAddressSpace.AddVMA(heapAddress, HEAP_WINDOW_SIZE, PAGE_MAP_DEFAULT, VMABacking::VMAAnonymous);
 }
 
 void free(void* address){
+    if (address == NULL) return;
     HeapSegHdr* segment = (HeapSegHdr*)address - 1;
     segment->free = true;
-    segment->CombineForward();
-    segment->CombineBackward();
+    FreedSinceTrim += segment->length;
+    InsertFree(Coalesce(segment));
 }
 
 void* malloc(size_t size){
@@ -41,24 +144,21 @@ void* malloc(size_t size){
 
     if (size == 0) return NULL;
 
-    HeapSegHdr* currentSeg = (HeapSegHdr*) heapStart;
-    while(true){
-        if(currentSeg->free){
-            if (currentSeg->length > size){
-                currentSeg->Split(size);
-                currentSeg->free = false;
-                return (void*)((uint64_t)currentSeg + sizeof(HeapSegHdr));
-            }
-            if (currentSeg->length == size){
-                currentSeg->free = false;
-                return (void*)((uint64_t)currentSeg + sizeof(HeapSegHdr));
-            }
-        }
-        if (currentSeg->next == NULL) break;
-        currentSeg = currentSeg->next;
+    HeapSegHdr* segment = FindFree(size);
+    if (segment == NULL){
+        // room for the header and the class rounding FindFree applies
+        size_t needed = size + sizeof(HeapSegHdr);
+        if (size >= HEAP_SMALL_LENGTH) needed += (size_t)1 << (HighestBit(size) - HEAP_SL_SHIFT);
+        if (!ExpandHeap(needed)) return NULL;
+        segment = FindFree(size);
+        if (segment == NULL) return NULL;
     }
-    ExpandHeap(size);
-    return malloc(size);
+
+    RemoveFree(segment);
+    HeapSegHdr* rest = segment->Split(size);
+    if (rest != NULL) InsertFree(rest);
+    segment->free = false;
+    return (void*)((uint64_t)segment + sizeof(HeapSegHdr));
 }
 
 HeapSegHdr* HeapSegHdr::Split(size_t splitLength){
@@ -67,7 +167,7 @@ HeapSegHdr* HeapSegHdr::Split(size_t splitLength){
     if (splitSegLength < 0x10) return NULL;
 
     HeapSegHdr* newSplitHdr = (HeapSegHdr*) ((size_t)this + splitLength + sizeof(HeapSegHdr));
-    next->last = newSplitHdr; // Set the next segment's last segment to our new segment
+    if (next != NULL) next->last = newSplitHdr; // Set the next segment's last segment to our new segment
     newSplitHdr->next = next; // Set the new segment's next segment to out original next segment
     next = newSplitHdr; // Set our new segment to the new segment
     newSplitHdr->last = this; // Set our new segment's last segment to the current segment
@@ -79,19 +179,51 @@ HeapSegHdr* HeapSegHdr::Split(size_t splitLength){
     return newSplitHdr;
 }
 
-void ExpandHeap(size_t length){
+static inline size_t AlignUp(size_t value, size_t alignment){
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Backs every unmapped 2 MiB aligned piece of [start, end) with one 2 MiB page. Pieces the
+// buddy allocator has no block for are left to the page fault handler. The range lies past
+// the old heap end, where pages were either never mapped or trimmed a whole arena at a time.
+static void MapLargePages(size_t start, size_t end){
+    for (size_t page = AlignUp(start, PAGE_SIZE_2MIB); page + PAGE_SIZE_2MIB <= end; page += PAGE_SIZE_2MIB){
+        if (g_PageTableManager.Translate((void*)page) != PAGE_NOT_MAPPED) continue;
+        void* frames = GlobalAllocator.RequestPages(9);
+        if (frames == NULL) return;
+        g_PageTableManager.MapRange((void*)page, frames, PAGE_SIZE_2MIB / 0x1000);
+    }
+}
+
+// Unmaps [start, end) and drops the frames behind it. The heap area faults in fresh zeroed
+// pages if the range is used again.
+static uint64_t ReleasePages(size_t start, size_t end){
+    if (end <= start) return 0;
+    uint64_t released = 0;
+    for (size_t page = start; page < end; page += 0x1000){
+        uint64_t frame = g_PageTableManager.Translate((void*)page);
+        if (frame == PAGE_NOT_MAPPED) continue;
+        GlobalAllocator.PutPage((void*)frame);
+        released++;
+    }
+    g_PageTableManager.UnmapRange((void*)start, (end - start) / 0x1000);
+    return released;
+}
+
+// Moves the end of the heap; the page fault handler backs the new pages as they get used, or
+// with large pages on, whole 2 MiB arenas are mapped up front
+bool ExpandHeap(size_t length){
     if (length % 0x1000) {
         length -= length % 0x1000;
         length += 0x1000;
     }
+    if (LargePages) length = AlignUp((size_t)heapEnd + length, HEAP_ARENA_SIZE) - (size_t)heapEnd;
 
-    size_t pageCount = length / 0x1000;
-    HeapSegHdr* newSegment = (HeapSegHdr*)heapEnd;
+    if ((size_t)heapEnd + length > (size_t)heapStart + HEAP_WINDOW_SIZE) return false;
+    if (LargePages) MapLargePages((size_t)heapEnd, (size_t)heapEnd + length);
 
-    for (size_t i = 0; i < pageCount; i++){
-        g_PageTableManager.MapMemory(heapEnd, GlobalAllocator.RequestPage());
-        heapEnd = (void*)((size_t)heapEnd + 0x1000);
-    }
+    HeapSegHdr* newSegment = (HeapSegHdr*)heapEnd;
+    heapEnd = (void*)((size_t)heapEnd + length);
 
     newSegment->free = true;
     newSegment->last = LastHdr;
@@ -99,8 +231,51 @@ void ExpandHeap(size_t length){
     LastHdr = newSegment;
     newSegment->next = NULL;
     newSegment->length = length - sizeof(HeapSegHdr);
-    newSegment->CombineBackward();
+    InsertFree(Coalesce(newSegment));
+    return true;
+}
+
+// Hands the whole pages of large free segments back to the frame allocator, and pulls the end
+// of the heap back over a free tail. Called from the idle loop; does nothing until
+// HEAP_TRIM_THRESHOLD bytes have been freed since the last pass. Returns the pages released.
+uint64_t TrimHeap(){
+    if (FreedSinceTrim < HEAP_TRIM_THRESHOLD) return 0;
+    FreedSinceTrim = 0;
+
+    // large pages are only released whole, so trimming never splits an arena's mapping
+    size_t granule = LargePages ? PAGE_SIZE_2MIB : 0x1000;
+    uint64_t released = 0;
+
+    HeapSegHdr* tail = LastHdr;
+    size_t tailEnd = AlignUp((size_t)tail + sizeof(HeapSegHdr) + 0x10, granule);
+    if (tail->free && tail != heapStart && tailEnd < (size_t)heapEnd && (size_t)heapEnd - tailEnd >= HEAP_TRIM_THRESHOLD){
+        RemoveFree(tail);
+        released += ReleasePages(tailEnd, (size_t)heapEnd);
+        tail->length = tailEnd - (size_t)tail - sizeof(HeapSegHdr);
+        heapEnd = (void*)tailEnd;
+        InsertFree(tail);
+    }
 
+    // only the size classes that can hold HEAP_TRIM_THRESHOLD bytes
+    uint64_t fl, sl;
+    MapLength(HEAP_TRIM_THRESHOLD, &fl, &sl);
+    for (; fl < HEAP_FL_COUNT; fl++){
+        if (!(FirstLevelMap & ((uint64_t)1 << fl))) continue;
+        for (uint64_t i = 0; i < HEAP_SL_COUNT; i++){
+            for (HeapSegHdr* segment = FreeLists[fl][i]; segment != NULL; segment = segment->nextFree){
+                if (segment->trimmed || segment->length < HEAP_TRIM_THRESHOLD) continue;
+                size_t start = AlignUp((size_t)segment + sizeof(HeapSegHdr), granule);
+                size_t end = ((size_t)segment + sizeof(HeapSegHdr) + segment->length) & ~(granule - 1);
+                released += ReleasePages(start, end);
+                segment->trimmed = true;
+            }
+        }
+    }
+    return released;
+}
+
+void SetHeapLargePages(bool enabled){
+    LargePages = enabled;
 }
 
 void HeapSegHdr::CombineForward(){
@@ -123,4 +298,3 @@ void HeapSegHdr::CombineForward(){
 void HeapSegHdr::CombineBackward(){
     if (last != NULL && last->free) last->CombineForward();
 }
-
@@ -2,24 +2,48 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Segments tile the heap in address order through next/last, which act as the boundary tags
+// for coalescing. A free segment also sits on the list of its size class through nextFree/lastFree.
 struct HeapSegHdr{
     size_t length;
     HeapSegHdr* next;
     HeapSegHdr* last;
     bool free;
+    bool trimmed; // free and its whole pages already handed back by TrimHeap
+    HeapSegHdr* nextFree;
+    HeapSegHdr* lastFree;
     void CombineForward();
     void CombineBackward();
     HeapSegHdr* Split(size_t splitLength);
 };
 
+// Two level segregated fit (TLSF): the first level is the power of two of a segment's length,
+// the second splits each power of two into HEAP_SL_COUNT classes. Lengths below
+// HEAP_SMALL_LENGTH go into first level 0 in steps of 0x10.
+#define HEAP_SL_SHIFT 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_SHIFT)
+#define HEAP_FL_SHIFT 8 // HEAP_SL_SHIFT + log2 of the 0x10 granularity
+#define HEAP_SMALL_LENGTH (1 << HEAP_FL_SHIFT)
+#define HEAP_FL_COUNT (40 - HEAP_FL_SHIFT + 1) // lengths below 1 TiB, the whole window
+
+#define HEAP_BASE 0xffffc00000000000 // kernel half, so every address space shares the heap
+#define HEAP_WINDOW_SIZE 0x10000000000 // 1 TiB of virtual space, backed on first touch
+#define HEAP_TRIM_THRESHOLD 0x40000 // free segments this big give their pages back, once this much has been freed
+#define HEAP_ARENA_SIZE 0x200000 // growth step with large pages on, one 2 MiB page per arena
+
 void InitializeHeap(void* heapAddress, size_t pageCount);
 
 void* malloc(size_t size);
 void free(void* address);
 
-void ExpandHeap(size_t length);
+bool ExpandHeap(size_t length);
+uint64_t TrimHeap();
+void SetHeapLargePages(bool enabled);
 
 inline void* operator new(size_t size) {return malloc(size);}
 inline void* operator new[](size_t size) {return malloc(size);}
 
-inline void operator delete(void* p) {free(p);}
\ No newline at end of file
+inline void operator delete(void* p) {free(p);}
+inline void operator delete(void* p, size_t) {free(p);}
+inline void operator delete[](void* p) {free(p);}
+inline void operator delete[](void* p, size_t) {free(p);}
@@ -0,0 +1,45 @@
+#include "memops.h"
+#include "vmalloc.h"
+#include "../printf.h"
+#include "../alternatives.h"
+
+#define MEMORY_BENCH_MAX 0x1000000 // 16 MiB
+#define MEMORY_BENCH_BYTES 0x4000000 // each size is repeated until about 64 MiB have been moved
+
+// Prints cycles per call of every supported set/copy variant, 16 B to 16 MiB in steps of 4x
+void BenchmarkMemoryRoutines(){
+    uint8_t* source = (uint8_t*)vmalloc(MEMORY_BENCH_MAX);
+    uint8_t* destination = (uint8_t*)vmalloc(MEMORY_BENCH_MAX);
+    if (source == NULL || destination == NULL){
+        kernel_printf("[MEMORY BENCHMARK] not enough memory\n");
+        vfree(source);
+        vfree(destination);
+        return;
+    }
+    MemoryVariants[MemoryVariant::MemoryGeneric].set(source, 0x5a, MEMORY_BENCH_MAX);
+    MemoryVariants[MemoryVariant::MemoryGeneric].set(destination, 0, MEMORY_BENCH_MAX);
+
+    kernel_printf("[MEMORY BENCHMARK] active: %s, cycles per call\n", MemoryVariants[GetMemoryVariant()].name);
+    for (int v = 0; v < MemoryVariantCount; v++){
+        MemoryRoutines* routines = &MemoryVariants[v];
+        if (!routines->supported) continue;
+        kernel_printf("  %s\n", routines->name);
+
+        for (size_t size = 16; size <= MEMORY_BENCH_MAX; size *= 4){
+            uint64_t iterations = MEMORY_BENCH_BYTES / size;
+
+            uint64_t start = ReadTSC();
+            for (uint64_t i = 0; i < iterations; i++) routines->set(destination, (uint8_t)i, size);
+            uint64_t setCycles = (ReadTSC() - start) / iterations;
+
+            start = ReadTSC();
+            for (uint64_t i = 0; i < iterations; i++) routines->copy(destination, source, size);
+            uint64_t copyCycles = (ReadTSC() - start) / iterations;
+
+            kernel_printf("    %u bytes: set %u, copy %u\n", (unsigned int)size, (unsigned int)setCycles, (unsigned int)copyCycles);
+        }
+    }
+
+    vfree(source);
+    vfree(destination);
+}
@@ -0,0 +1,337 @@
+#include "memops.h"
+#include "../memory.h"
+#include "../cpu.h"
+#include "../alternatives.h"
+
+// The vector variants clobber xmm0-xmm2/ymm0-ymm2. Interrupt handlers reach them only
+// inside KernelFPUBegin/End, so interrupted vector code keeps its registers.
+
+static void SetGeneric(void* destination, uint8_t value, size_t num){
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    size_t qwords = num / 8;
+    size_t bytes = num % 8;
+    asm volatile ("rep stosq" : "+D"(destination), "+c"(qwords) : "a"(pattern) : "memory");
+    asm volatile ("rep stosb" : "+D"(destination), "+c"(bytes) : "a"(pattern) : "memory");
+}
+
+static void CopyGeneric(void* destination, const void* source, size_t num){
+    size_t qwords = num / 8;
+    size_t bytes = num % 8;
+    asm volatile ("rep movsq" : "+D"(destination), "+S"(source), "+c"(qwords) : : "memory");
+    asm volatile ("rep movsb" : "+D"(destination), "+S"(source), "+c"(bytes) : : "memory");
+}
+
+static void SetERMS(void* destination, uint8_t value, size_t num){
+    asm volatile ("rep stosb" : "+D"(destination), "+c"(num) : "a"(value) : "memory");
+}
+
+static void CopyERMS(void* destination, const void* source, size_t num){
+    asm volatile ("rep movsb" : "+D"(destination), "+S"(source), "+c"(num) : : "memory");
+}
+
+// Unaligned stores cover the first and last 16 bytes, aligned stores everything in between
+static void SetSSE2(void* destination, uint8_t value, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        SetERMS(destination, value, num);
+        return;
+    }
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    uint64_t p, end, next;
+    asm volatile (
+        "movq %[pattern], %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "movdqu %%xmm0, (%[dst])\n\t"
+        "movdqu %%xmm0, -16(%[dst], %[num])\n\t"
+        "lea 16(%[dst]), %[p]\n\t"
+        "and $-16, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-16, %[end]\n\t"
+        "1:\n\t"
+        "lea 64(%[p]), %[next]\n\t"
+        "cmp %[end], %[next]\n\t"
+        "ja 2f\n\t"
+        "movdqa %%xmm0, (%[p])\n\t"
+        "movdqa %%xmm0, 16(%[p])\n\t"
+        "movdqa %%xmm0, 32(%[p])\n\t"
+        "movdqa %%xmm0, 48(%[p])\n\t"
+        "mov %[next], %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 3f\n\t"
+        "movdqa %%xmm0, (%[p])\n\t"
+        "add $16, %[p]\n\t"
+        "jmp 2b\n\t"
+        "3:\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end), [next] "=&r"(next)
+        : [dst] "r"(destination), [num] "r"(num), [pattern] "r"(pattern)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+// The first and last 16 bytes are loaded up front and stored last, which also keeps a
+// forward copy correct when the destination overlaps below the source
+static void CopySSE2(void* destination, const void* source, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        CopyERMS(destination, source, num);
+        return;
+    }
+    uint64_t p, end;
+    uint64_t delta = (uint64_t)source - (uint64_t)destination;
+    asm volatile (
+        "movdqu (%[src]), %%xmm1\n\t"
+        "movdqu -16(%[src], %[num]), %%xmm2\n\t"
+        "lea 16(%[dst]), %[p]\n\t"
+        "and $-16, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-16, %[end]\n\t"
+        "1:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 2f\n\t"
+        "movdqu (%[p], %[delta]), %%xmm0\n\t"
+        "movdqa %%xmm0, (%[p])\n\t"
+        "add $16, %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "movdqu %%xmm1, (%[dst])\n\t"
+        "movdqu %%xmm2, -16(%[dst], %[num])\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end)
+        : [dst] "r"(destination), [src] "r"(source), [num] "r"(num), [delta] "r"(delta)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+static void SetAVX2(void* destination, uint8_t value, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        SetERMS(destination, value, num);
+        return;
+    }
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    uint64_t p, end, next;
+    asm volatile (
+        "vmovq %[pattern], %%xmm0\n\t"
+        "vpbroadcastq %%xmm0, %%ymm0\n\t"
+        "vmovdqu %%ymm0, (%[dst])\n\t"
+        "vmovdqu %%ymm0, -32(%[dst], %[num])\n\t"
+        "lea 32(%[dst]), %[p]\n\t"
+        "and $-32, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-32, %[end]\n\t"
+        "1:\n\t"
+        "lea 128(%[p]), %[next]\n\t"
+        "cmp %[end], %[next]\n\t"
+        "ja 2f\n\t"
+        "vmovdqa %%ymm0, (%[p])\n\t"
+        "vmovdqa %%ymm0, 32(%[p])\n\t"
+        "vmovdqa %%ymm0, 64(%[p])\n\t"
+        "vmovdqa %%ymm0, 96(%[p])\n\t"
+        "mov %[next], %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 3f\n\t"
+        "vmovdqa %%ymm0, (%[p])\n\t"
+        "add $32, %[p]\n\t"
+        "jmp 2b\n\t"
+        "3:\n\t"
+        "vzeroupper\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end), [next] "=&r"(next)
+        : [dst] "r"(destination), [num] "r"(num), [pattern] "r"(pattern)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+static void CopyAVX2(void* destination, const void* source, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        CopyERMS(destination, source, num);
+        return;
+    }
+    uint64_t p, end;
+    uint64_t delta = (uint64_t)source - (uint64_t)destination;
+    asm volatile (
+        "vmovdqu (%[src]), %%ymm1\n\t"
+        "vmovdqu -32(%[src], %[num]), %%ymm2\n\t"
+        "lea 32(%[dst]), %[p]\n\t"
+        "and $-32, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-32, %[end]\n\t"
+        "1:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 2f\n\t"
+        "vmovdqu (%[p], %[delta]), %%ymm0\n\t"
+        "vmovdqa %%ymm0, (%[p])\n\t"
+        "add $32, %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "vmovdqu %%ymm1, (%[dst])\n\t"
+        "vmovdqu %%ymm2, -32(%[dst], %[num])\n\t"
+        "vzeroupper\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end)
+        : [dst] "r"(destination), [src] "r"(source), [num] "r"(num), [delta] "r"(delta)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+// Streaming stores skip the cache, so a 16 MiB clear does not evict everything else
+static void SetNonTemporal(void* destination, uint8_t value, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        SetERMS(destination, value, num);
+        return;
+    }
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    uint64_t p, end, next;
+    asm volatile (
+        "movq %[pattern], %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "movdqu %%xmm0, (%[dst])\n\t"
+        "movdqu %%xmm0, -16(%[dst], %[num])\n\t"
+        "lea 16(%[dst]), %[p]\n\t"
+        "and $-16, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-16, %[end]\n\t"
+        "1:\n\t"
+        "lea 64(%[p]), %[next]\n\t"
+        "cmp %[end], %[next]\n\t"
+        "ja 2f\n\t"
+        "movntdq %%xmm0, (%[p])\n\t"
+        "movntdq %%xmm0, 16(%[p])\n\t"
+        "movntdq %%xmm0, 32(%[p])\n\t"
+        "movntdq %%xmm0, 48(%[p])\n\t"
+        "mov %[next], %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 3f\n\t"
+        "movntdq %%xmm0, (%[p])\n\t"
+        "add $16, %[p]\n\t"
+        "jmp 2b\n\t"
+        "3:\n\t"
+        "sfence\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end), [next] "=&r"(next)
+        : [dst] "r"(destination), [num] "r"(num), [pattern] "r"(pattern)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+static void CopyNonTemporal(void* destination, const void* source, size_t num){
+    if (num < MEMORY_VECTOR_MIN){
+        CopyERMS(destination, source, num);
+        return;
+    }
+    uint64_t p, end;
+    uint64_t delta = (uint64_t)source - (uint64_t)destination;
+    asm volatile (
+        "movdqu (%[src]), %%xmm1\n\t"
+        "movdqu -16(%[src], %[num]), %%xmm2\n\t"
+        "lea 16(%[dst]), %[p]\n\t"
+        "and $-16, %[p]\n\t"
+        "lea (%[dst], %[num]), %[end]\n\t"
+        "and $-16, %[end]\n\t"
+        "1:\n\t"
+        "cmp %[end], %[p]\n\t"
+        "jae 2f\n\t"
+        "movdqu (%[p], %[delta]), %%xmm0\n\t"
+        "movntdq %%xmm0, (%[p])\n\t"
+        "add $16, %[p]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "sfence\n\t"
+        "movdqu %%xmm1, (%[dst])\n\t"
+        "movdqu %%xmm2, -16(%[dst], %[num])\n\t"
+        : [p] "=&r"(p), [end] "=&r"(end)
+        : [dst] "r"(destination), [src] "r"(source), [num] "r"(num), [delta] "r"(delta)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+}
+
+MemoryRoutines MemoryVariants[MemoryVariantCount] = {
+    {"generic", true, SetGeneric, CopyGeneric},
+    {"erms", false, SetERMS, CopyERMS},
+    {"sse2", true, SetSSE2, CopySSE2},
+    {"avx2", false, SetAVX2, CopyAVX2},
+    {"non-temporal", true, SetNonTemporal, CopyNonTemporal},
+};
+
+static MemoryVariant ActiveVariant = MemoryVariant::MemoryGeneric;
+static MemoryRoutines* Active = &MemoryVariants[MemoryVariant::MemoryGeneric];
+
+void InitializeMemoryRoutines(){
+    MemoryVariants[MemoryVariant::MemoryERMS].supported = CPUHasFeature(CPU_FEATURE_ERMS);
+    MemoryVariants[MemoryVariant::MemoryAVX2].supported = CPUHasFeature(CPU_FEATURE_AVX2);
+
+    if (MemoryVariants[MemoryVariant::MemoryERMS].supported) ActiveVariant = MemoryVariant::MemoryERMS;
+    else if (MemoryVariants[MemoryVariant::MemoryAVX2].supported) ActiveVariant = MemoryVariant::MemoryAVX2;
+    else ActiveVariant = MemoryVariant::MemorySSE2;
+    Active = &MemoryVariants[ActiveVariant];
+}
+
+MemoryVariant GetMemoryVariant(){
+    return ActiveVariant;
+}
+
+void* memset(void* start, int value, size_t num){
+    if (num >= MEMORY_NT_THRESHOLD) SetNonTemporal(start, (uint8_t)value, num);
+    else if (CPUHas<CPU_FEATURE_ERMS>()) SetERMS(start, (uint8_t)value, num); // patched, no indirect call
+    else Active->set(start, (uint8_t)value, num);
+    return start;
+}
+
+void* memcpy(void* destination, const void* source, size_t num){
+    if (num >= MEMORY_NT_THRESHOLD) CopyNonTemporal(destination, source, num);
+    else if (CPUHas<CPU_FEATURE_ERMS>()) CopyERMS(destination, source, num);
+    else Active->copy(destination, source, num);
+    return destination;
+}
+
+// Forward copies are safe unless the destination starts inside the source
+void* memmove(void* destination, const void* source, size_t num){
+    uint64_t dst = (uint64_t)destination;
+    uint64_t src = (uint64_t)source;
+    if (dst <= src || dst >= src + num) return memcpy(destination, source, num);
+
+    uint8_t* d = (uint8_t*)destination + num;
+    const uint8_t* s = (const uint8_t*)source + num;
+    for (size_t i = num % 8; i > 0; i--){
+        *--d = *--s;
+    }
+    size_t qwords = num / 8;
+    if (qwords > 0){
+        d -= 8;
+        s -= 8;
+        asm volatile ("std\n\trep movsq\n\tcld" : "+D"(d), "+S"(s), "+c"(qwords) : : "memory", "cc");
+    }
+    return destination;
+}
+
+// SSE2 compares 16 bytes at a time, leaving the first differing offset in index
+static size_t FindMismatch(const void* a, const void* b, size_t num){
+    size_t index = 0;
+    size_t blocks = num & ~(size_t)15;
+    if (blocks == 0) return 0;
+
+    uint64_t mask;
+    asm volatile (
+        "1:\n\t"
+        "cmp %[blocks], %[index]\n\t"
+        "jae 3f\n\t"
+        "movdqu (%[a], %[index]), %%xmm0\n\t"
+        "movdqu (%[b], %[index]), %%xmm1\n\t"
+        "pcmpeqb %%xmm1, %%xmm0\n\t"
+        "pmovmskb %%xmm0, %k[mask]\n\t"
+        "cmp $0xffff, %k[mask]\n\t"
+        "jne 2f\n\t"
+        "add $16, %[index]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "not %k[mask]\n\t"
+        "bsf %k[mask], %k[mask]\n\t"
+        "add %[mask], %[index]\n\t"
+        "3:\n\t"
+        : [index] "+r"(index), [mask] "=&r"(mask)
+        : [a] "r"(a), [b] "r"(b), [blocks] "r"(blocks)
+        : "memory", "cc", "xmm0", "xmm1", "xmm2");
+    return index;
+}
+
+int memcmp(const void* a, const void* b, size_t num){
+    const uint8_t* left = (const uint8_t*)a;
+    const uint8_t* right = (const uint8_t*)b;
+    for (size_t i = FindMismatch(a, b, num); i < num; i++){
+        if (left[i] != right[i]) return left[i] < right[i] ? -1 : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define MEMORY_NT_THRESHOLD 0x100000 // fills and copies this big bypass the caches
+#define MEMORY_VECTOR_MIN 64 // below this the vector variants fall back to rep stosb/movsb
+
+enum MemoryVariant {
+    MemoryGeneric = 0, // rep stosq/movsq, always available
+    MemoryERMS = 1,    // rep stosb/movsb on CPUs with enhanced (and fast short) rep strings
+    MemorySSE2 = 2,
+    MemoryAVX2 = 3,
+    MemoryNonTemporal = 4, // SSE2 streaming stores, used for everything past MEMORY_NT_THRESHOLD
+    MemoryVariantCount = 5,
+};
+
+struct MemoryRoutines {
+    const char* name;
+    bool supported;
+    void (*set)(void* destination, uint8_t value, size_t num);
+    void (*copy)(void* destination, const void* source, size_t num);
+};
+
+extern MemoryRoutines MemoryVariants[MemoryVariantCount];
+
+// Picks the memset/memcpy variant from CPUID. Until then the generic one is used.
+void InitializeMemoryRoutines();
+MemoryVariant GetMemoryVariant();
+void BenchmarkMemoryRoutines();
@@ -0,0 +1,144 @@
+#include "slab.h"
+#include "heap.h"
+#include "../paging/PageFrameAllocator.h"
+#include "../paging/DirectMap.h"
+
+static inline size_t AlignUp(size_t value, size_t alignment){
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void PushSlab(Slab** list, Slab* slab){
+    slab->last = NULL;
+    slab->next = *list;
+    if (slab->next != NULL) slab->next->last = slab;
+    *list = slab;
+}
+
+static void RemoveSlab(Slab** list, Slab* slab){
+    if (slab->last != NULL) slab->last->next = slab->next;
+    else *list = slab->next;
+    if (slab->next != NULL) slab->next->last = slab->last;
+}
+
+SlabCache* kmem_cache_create(size_t size, size_t align, void (*ctor)(void*)){
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+    size_t objectSize = AlignUp(size, align);
+    size_t firstObject = AlignUp(sizeof(Slab), align);
+
+    uint8_t order = 0;
+    while (order < SLAB_MAX_ORDER && (((size_t)0x1000 << order) - firstObject) / objectSize < SLAB_MIN_OBJECTS) order++;
+    size_t slabSize = (size_t)0x1000 << order;
+    if (firstObject + objectSize > slabSize) return NULL;
+
+    SlabCache* cache = new SlabCache();
+    cache->objectSize = objectSize;
+    cache->slabSize = slabSize;
+    cache->order = order;
+    cache->objectsPerSlab = (slabSize - firstObject) / objectSize;
+    cache->firstObject = firstObject;
+    cache->colourStep = align > SLAB_CACHE_LINE ? align : SLAB_CACHE_LINE;
+    cache->colourCount = (slabSize - firstObject - cache->objectsPerSlab * objectSize) / cache->colourStep + 1;
+    cache->nextColour = 0;
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->emptyCount = 0;
+    return cache;
+}
+
+static Slab* GrowCache(SlabCache* cache){
+    void* frames = GlobalAllocator.RequestPages(cache->order);
+    if (frames == NULL) return NULL;
+
+    for (uint64_t i = 0; i < ((uint64_t)1 << cache->order); i++){
+        PageDescriptor* page = GlobalAllocator.GetPageDescriptor((void*)((uint64_t)frames + i * 0x1000));
+        if (page == NULL) continue;
+        page->type = PageTypeSlab;
+        page->owner = cache;
+    }
+
+    Slab* slab = (Slab*)PhysicalToVirtual(frames);
+    slab->cache = cache;
+    slab->inUse = 0;
+    slab->freeList = NULL;
+
+    uint64_t offset = cache->firstObject + (cache->nextColour % cache->colourCount) * cache->colourStep;
+    cache->nextColour++;
+
+    // link back to front so objects are handed out in address order
+    for (uint64_t i = cache->objectsPerSlab; i > 0; i--){
+        void** object = (void**)((uint64_t)slab + offset + (i - 1) * cache->objectSize);
+        *object = slab->freeList;
+        slab->freeList = object;
+    }
+    return slab;
+}
+
+static void ReleaseSlab(SlabCache* cache, Slab* slab){
+    GlobalAllocator.FreePages((void*)VirtualToPhysical(slab), (uint64_t)1 << cache->order);
+}
+
+void* kmem_cache_alloc(SlabCache* cache){
+    Slab* slab = cache->partial;
+    if (slab == NULL){
+        slab = cache->empty;
+        if (slab != NULL){
+            RemoveSlab(&cache->empty, slab);
+            cache->emptyCount--;
+        } else {
+            slab = GrowCache(cache);
+            if (slab == NULL) return NULL;
+        }
+        PushSlab(&cache->partial, slab);
+    }
+
+    void** object = (void**)slab->freeList;
+    slab->freeList = *object;
+    slab->inUse++;
+    if (slab->freeList == NULL){
+        RemoveSlab(&cache->partial, slab);
+        PushSlab(&cache->full, slab);
+    }
+
+    if (cache->ctor != NULL) cache->ctor(object);
+    return object;
+}
+
+void kmem_cache_free(SlabCache* cache, void* object){
+    if (object == NULL) return;
+    Slab* slab = (Slab*)((uint64_t)object & ~(uint64_t)(cache->slabSize - 1));
+
+    bool wasFull = slab->freeList == NULL;
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    slab->inUse--;
+
+    if (wasFull){
+        RemoveSlab(&cache->full, slab);
+        PushSlab(&cache->partial, slab);
+    }
+    if (slab->inUse == 0){
+        RemoveSlab(&cache->partial, slab);
+        if (cache->emptyCount >= SLAB_MAX_EMPTY){
+            ReleaseSlab(cache, slab);
+            return;
+        }
+        PushSlab(&cache->empty, slab);
+        cache->emptyCount++;
+    }
+}
+
+// Hands every empty slab back to the frame allocator, returning the number of pages freed
+uint64_t kmem_cache_shrink(SlabCache* cache){
+    uint64_t pages = 0;
+    while (cache->empty != NULL){
+        Slab* slab = cache->empty;
+        RemoveSlab(&cache->empty, slab);
+        ReleaseSlab(cache, slab);
+        pages += (uint64_t)1 << cache->order;
+    }
+    cache->emptyCount = 0;
+    return pages;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define SLAB_MAX_ORDER 3 // slabs are at most 2^3 pages
+#define SLAB_MIN_OBJECTS 8 // a slab grows until at least this many objects fit
+#define SLAB_CACHE_LINE 64
+#define SLAB_MAX_EMPTY 1 // empty slabs a cache keeps before handing the pages back
+
+struct SlabCache;
+
+// Header at the start of every slab. Slabs are naturally aligned blocks of frames, so an
+// object finds its slab by masking its address. Free objects are linked through their first word.
+struct Slab {
+    SlabCache* cache;
+    Slab* next;
+    Slab* last;
+    void* freeList;
+    uint64_t inUse;
+};
+
+// Objects of one size without per-object headers. Each new slab starts its objects one more
+// cache line in (its colour), using up the slack at the end of the slab, so that the same
+// object in different slabs does not always land in the same cache sets.
+struct SlabCache {
+    size_t objectSize;
+    size_t slabSize;
+    uint8_t order;
+    uint64_t objectsPerSlab;
+    uint64_t firstObject; // offset of the first object in an uncoloured slab
+    uint64_t colourStep;
+    uint64_t colourCount;
+    uint64_t nextColour;
+    void (*ctor)(void*);
+    Slab* partial;
+    Slab* full;
+    Slab* empty;
+    uint64_t emptyCount;
+};
+
+// align is a power of two, 0 for pointer alignment. ctor, if given, prepares each object as it is handed out.
+SlabCache* kmem_cache_create(size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(SlabCache* cache);
+void kmem_cache_free(SlabCache* cache, void* object);
+uint64_t kmem_cache_shrink(SlabCache* cache);
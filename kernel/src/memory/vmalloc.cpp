@@ -0,0 +1,76 @@
+#include "vmalloc.h"
+#include "../paging/VirtualRangeAllocator.h"
+#include "../paging/AddressSpace.h"
+#include "../paging/PageFrameAllocator.h"
+
+static VirtualRangeAllocator VmallocRanges;
+
+bool InitializeVmalloc(){
+    return VmallocRanges.Init(VMALLOC_BASE, VMALLOC_SIZE);
+}
+
+// Every area is a VMA of the kernel space, which remembers its size and drops its frames on removal
+static void ReleaseArea(void* address){
+    VMA* vma = KernelAddressSpace.FindVMA((uint64_t)address);
+    if (vma == NULL) return;
+
+    uint64_t start = vma->start;
+    uint64_t size = vma->end - vma->start;
+    KernelAddressSpace.RemoveVMA((void*)start);
+    VmallocRanges.Free(start, size + VMALLOC_GUARD_SIZE);
+}
+
+void* vmalloc(size_t size){
+    if (size == 0) return NULL;
+    uint64_t pageCount = (size + 0xfff) / 0x1000;
+    uint64_t bytes = pageCount * 0x1000;
+
+    uint64_t start = VmallocRanges.Allocate(bytes + VMALLOC_GUARD_SIZE, 0x1000);
+    if (start == VRANGE_NO_SPACE) return NULL;
+    if (KernelAddressSpace.AddVMA((void*)start, bytes, PAGE_MAP_DEFAULT, VMABacking::VMAAnonymous) == NULL){
+        VmallocRanges.Free(start, bytes + VMALLOC_GUARD_SIZE);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < pageCount; i++){
+        void* frame = GlobalAllocator.RequestPage();
+        if (frame == NULL){
+            ReleaseArea((void*)start);
+            return NULL;
+        }
+        g_PageTableManager.MapMemory((void*)(start + i * 0x1000), frame);
+    }
+    return (void*)start;
+}
+
+void vfree(void* address){
+    if (address == NULL) return;
+    ReleaseArea(address);
+}
+
+void* ioremap(uint64_t physicalAddress, size_t size, uint64_t type){
+    if (size == 0) return NULL;
+    uint64_t offset = physicalAddress & 0xfff;
+    uint64_t base = physicalAddress - offset;
+    uint64_t bytes = (offset + size + 0xfff) & ~(uint64_t)0xfff;
+
+    // same alignment as the physical range, so MapRange can use 2 MiB pages for big windows
+    uint64_t alignment = 0x1000;
+    if (bytes >= PAGE_SIZE_2MIB && (base & (PAGE_SIZE_2MIB - 1)) == 0) alignment = PAGE_SIZE_2MIB;
+
+    uint64_t start = VmallocRanges.Allocate(bytes + VMALLOC_GUARD_SIZE, alignment);
+    if (start == VRANGE_NO_SPACE) return NULL;
+
+    uint64_t flags = PageMapWrite | type;
+    if (KernelAddressSpace.AddVMA((void*)start, bytes, flags, VMABacking::VMADevice, base) == NULL){
+        VmallocRanges.Free(start, bytes + VMALLOC_GUARD_SIZE);
+        return NULL;
+    }
+    g_PageTableManager.MapRange((void*)start, (void*)base, bytes / 0x1000, flags);
+    return (void*)(start + offset);
+}
+
+void iounmap(void* address){
+    if (address == NULL) return;
+    ReleaseArea(address);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define VMALLOC_BASE 0xffffd00000000000 // kernel half, after the heap window
+#define VMALLOC_SIZE 0x10000000000 // 1 TiB
+#define VMALLOC_GUARD_SIZE 0x1000 // unmapped page after every area, so overruns fault
+
+bool InitializeVmalloc();
+
+// Virtually contiguous, physically scattered memory, for large buffers the heap and the
+// frame allocator should not have to find in one piece
+void* vmalloc(size_t size);
+void vfree(void* address);
+
+// Maps device memory (a BAR, the ECAM window) with a PAGE_MAP_* memory type
+void* ioremap(uint64_t physicalAddress, size_t size, uint64_t type);
+void iounmap(void* address);
@@ -0,0 +1,276 @@
+#include "AddressSpace.h"
+#include "PageFrameAllocator.h"
+#include "DirectMap.h"
+#include "TLB.h"
+#include "../memory/heap.h"
+#include "../memory/slab.h"
+
+AddressSpace KernelAddressSpace;
+AddressSpace* CurrentAddressSpace = &KernelAddressSpace;
+static SlabCache* VMACache;
+
+#define KERNEL_HALF_SLOT 256
+
+// AVL helpers, all O(log n) in the number of areas
+
+static inline int32_t Height(VMA* node){
+    return node == NULL ? 0 : node->height;
+}
+
+static inline void UpdateHeight(VMA* node){
+    int32_t left = Height(node->left);
+    int32_t right = Height(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+static VMA* RotateRight(VMA* node){
+    VMA* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    UpdateHeight(node);
+    UpdateHeight(pivot);
+    return pivot;
+}
+
+static VMA* RotateLeft(VMA* node){
+    VMA* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    UpdateHeight(node);
+    UpdateHeight(pivot);
+    return pivot;
+}
+
+static VMA* Balance(VMA* node){
+    UpdateHeight(node);
+    int32_t factor = Height(node->left) - Height(node->right);
+    if (factor > 1){
+        if (Height(node->left->left) < Height(node->left->right)) node->left = RotateLeft(node->left);
+        return RotateRight(node);
+    }
+    if (factor < -1){
+        if (Height(node->right->right) < Height(node->right->left)) node->right = RotateRight(node->right);
+        return RotateLeft(node);
+    }
+    return node;
+}
+
+static VMA* Insert(VMA* node, VMA* vma){
+    if (node == NULL) return vma;
+    if (vma->start < node->start) node->left = Insert(node->left, vma);
+    else node->right = Insert(node->right, vma);
+    return Balance(node);
+}
+
+static VMA* DetachMin(VMA* node, VMA** min){
+    if (node->left == NULL){
+        *min = node;
+        return node->right;
+    }
+    node->left = DetachMin(node->left, min);
+    return Balance(node);
+}
+
+static VMA* Remove(VMA* node, uint64_t start){
+    if (node == NULL) return NULL;
+    if (start < node->start){
+        node->left = Remove(node->left, start);
+        return Balance(node);
+    }
+    if (start > node->start){
+        node->right = Remove(node->right, start);
+        return Balance(node);
+    }
+
+    if (node->right == NULL) return node->left;
+    VMA* successor;
+    VMA* right = DetachMin(node->right, &successor);
+    successor->left = node->left;
+    successor->right = right;
+    return Balance(successor);
+}
+
+SharedMemory* CreateSharedMemory(uint64_t pageCount){
+    SharedMemory* shared = new SharedMemory();
+    shared->pageCount = pageCount;
+    shared->mappings = 0;
+    shared->frames = (void**)malloc(pageCount * sizeof(void*));
+    for (uint64_t i = 0; i < pageCount; i++){
+        shared->frames[i] = NULL;
+    }
+    return shared;
+}
+
+// Takes over the boot page tables. Every kernel half PDP table is allocated now, so spaces
+// created later can copy the PML4's upper half once and never fall out of sync.
+void AddressSpace::InitKernel(PageTableManager* kernelTables){
+    Tables = kernelTables;
+    Root = NULL;
+
+    for (uint64_t i = KERNEL_HALF_SLOT; i < 512; i++){
+        PageDirectoryEntry* entry = &Tables->PML4->entries[i];
+        if (entry->GetFlag(PT_Flag::Present)) continue;
+        entry->Value = 0;
+        entry->SetAddress((uint64_t)GlobalAllocator.RequestZeroedPage() >> 12);
+        entry->SetFlag(PT_Flag::Present, true);
+        entry->SetFlag(PT_Flag::ReadWrite, true);
+    }
+}
+
+AddressSpace* AddressSpace::Create(){
+    void* frame = GlobalAllocator.RequestZeroedPage();
+    if (frame == NULL) return NULL;
+
+    PageTable* PML4 = (PageTable*)PhysicalToVirtual(frame);
+    for (uint64_t i = KERNEL_HALF_SLOT; i < 512; i++){
+        PML4->entries[i] = KernelAddressSpace.Tables->PML4->entries[i];
+    }
+
+    AddressSpace* space = new AddressSpace();
+    space->Tables = new PageTableManager(PML4);
+    space->Tables->PCID = AllocatePCID();
+    space->Root = NULL;
+    return space;
+}
+
+// Unmaps every area and frees the lower half tables, the PML4 and the PCID. The space must not be loaded.
+void AddressSpace::Destroy(){
+    while (Root != NULL){
+        RemoveVMA((void*)Root->start);
+    }
+    Tables->UnmapRange(0, (KERNEL_HALF_SLOT * PAGE_SIZE_1GIB * 512) / PAGE_SIZE_4KIB);
+
+    // the PCID may still tag stale entries of this space; flush before it can be handed out again
+    if (Tables->PCID != PCID_KERNEL) FlushTLB();
+    FreePCID(Tables->PCID);
+    GlobalAllocator.FreePage((void*)VirtualToPhysical(Tables->PML4));
+    delete Tables;
+    delete this;
+}
+
+void AddressSpace::Activate(){
+    Tables->Activate();
+    CurrentAddressSpace = this;
+}
+
+VMA* AddressSpace::FindVMA(uint64_t address){
+    VMA* node = Root;
+    while (node != NULL){
+        if (address < node->start) node = node->left;
+        else if (address >= node->end) node = node->right;
+        else return node;
+    }
+    return NULL;
+}
+
+VMA* AddressSpace::FindOverlap(uint64_t start, uint64_t end){
+    VMA* node = Root;
+    while (node != NULL){
+        if (end <= node->start) node = node->left;
+        else if (start >= node->end) node = node->right;
+        else return node;
+    }
+    return NULL;
+}
+
+// Records an area; nothing is mapped until it is touched. Returns NULL if it overlaps another one.
+VMA* AddressSpace::AddVMA(void* start, uint64_t size, uint64_t flags, VMABacking backing, uint64_t offset, void* object){
+    uint64_t first = (uint64_t)start & ~(uint64_t)0xfff;
+    uint64_t end = ((uint64_t)start + size + 0xfff) & ~(uint64_t)0xfff;
+    if (end <= first || FindOverlap(first, end) != NULL) return NULL;
+
+    if (VMACache == NULL) VMACache = kmem_cache_create(sizeof(VMA), 0, NULL);
+    if (VMACache == NULL) return NULL;
+    VMA* vma = (VMA*)kmem_cache_alloc(VMACache);
+    if (vma == NULL) return NULL;
+    vma->start = first;
+    vma->end = end;
+    vma->flags = flags;
+    vma->backing = backing;
+    vma->offset = offset;
+    vma->object = object;
+    vma->left = NULL;
+    vma->right = NULL;
+    vma->height = 1;
+    if (backing == VMABacking::VMAShared) ((SharedMemory*)object)->mappings++;
+
+    Root = Insert(Root, vma);
+    return vma;
+}
+
+// Drops the page references an area holds, then its mappings
+void AddressSpace::ReleaseVMA(VMA* vma){
+    uint64_t pageCount = (vma->end - vma->start) / PAGE_SIZE_4KIB;
+
+    if (vma->backing == VMABacking::VMAAnonymous || vma->backing == VMABacking::VMAShared){
+        for (uint64_t i = 0; i < pageCount; i++){
+            uint64_t frame = Tables->Translate((void*)(vma->start + i * PAGE_SIZE_4KIB));
+            if (frame != PAGE_NOT_MAPPED) GlobalAllocator.PutPage((void*)frame);
+        }
+    }
+    Tables->UnmapRange((void*)vma->start, pageCount);
+
+    if (vma->backing == VMABacking::VMAShared){
+        SharedMemory* shared = (SharedMemory*)vma->object;
+        if (--shared->mappings == 0){
+            for (uint64_t i = 0; i < shared->pageCount; i++){
+                if (shared->frames[i] != NULL) GlobalAllocator.PutPage(shared->frames[i]);
+            }
+            free(shared->frames);
+            delete shared;
+        }
+    }
+}
+
+bool AddressSpace::RemoveVMA(void* start){
+    VMA* vma = FindVMA((uint64_t)start);
+    if (vma == NULL) return false;
+
+    ReleaseVMA(vma);
+    Root = Remove(Root, vma->start);
+    kmem_cache_free(VMACache, vma);
+    return true;
+}
+
+// Resolves a missing page inside an area. Protection faults, writes to read-only areas and
+// addresses outside every area are left to the caller.
+bool AddressSpace::HandleFault(uint64_t address, uint64_t errorCode){
+    if (errorCode & PAGE_FAULT_PRESENT) return false;
+
+    VMA* vma = FindVMA(address);
+    if (vma == NULL) return false;
+    if ((errorCode & PAGE_FAULT_WRITE) && !(vma->flags & PageMapWrite)) return false;
+
+    uint64_t page = address & ~(uint64_t)0xfff;
+    uint64_t index = (page - vma->start) / PAGE_SIZE_4KIB;
+    void* frame = NULL;
+
+    switch (vma->backing){
+        case VMABacking::VMAAnonymous:
+            frame = GlobalAllocator.RequestZeroedPage();
+            break;
+        case VMABacking::VMADevice:
+            frame = (void*)(vma->offset + index * PAGE_SIZE_4KIB);
+            break;
+        case VMABacking::VMAShared: {
+            SharedMemory* shared = (SharedMemory*)vma->object;
+            if (index >= shared->pageCount) return false;
+            if (shared->frames[index] == NULL) shared->frames[index] = GlobalAllocator.RequestZeroedPage();
+            frame = shared->frames[index];
+            if (frame != NULL) GlobalAllocator.GetPage(frame); // the mapping's reference
+            break;
+        }
+        case VMABacking::VMAFile:
+            return false;
+    }
+    if (frame == NULL) return false;
+
+    Tables->MapRange((void*)page, frame, 1, vma->flags);
+    return true;
+}
+
+// Page fault entry point: the kernel half belongs to the kernel space, the rest to whatever is loaded
+bool HandleMemoryFault(uint64_t address, uint64_t errorCode){
+    if (address >= KERNEL_HALF_BASE) return KernelAddressSpace.HandleFault(address, errorCode);
+    return CurrentAddressSpace->HandleFault(address, errorCode);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "PageTableManager.h"
+
+#define PAGE_FAULT_PRESENT (1 << 0) // error code: set for protection faults, clear for missing pages
+#define PAGE_FAULT_WRITE (1 << 1)
+
+enum VMABacking {
+    VMAAnonymous = 0, // zeroed frames on first touch
+    VMADevice = 1,    // physical range starting at offset, e.g. a BAR
+    VMAFile = 2,      // offset into object; there is no file system to page from yet
+    VMAShared = 3,    // frames of a SharedMemory object, the same in every space mapping it
+};
+
+// Frames shared between address spaces. Each mapping holds a page reference on the frames it
+// has faulted in, the object holds one more until the last VMA using it goes away.
+struct SharedMemory {
+    uint64_t pageCount;
+    uint64_t mappings;
+    void** frames;
+};
+
+SharedMemory* CreateSharedMemory(uint64_t pageCount);
+
+// Virtual memory area, a node of the AVL tree keyed by start. Areas never overlap.
+struct VMA {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags; // PageMapFlag bits
+    VMABacking backing;
+    uint64_t offset;
+    void* object;
+    VMA* left;
+    VMA* right;
+    int32_t height;
+};
+
+// A PML4 and the areas mapped through it. The kernel half (PML4 slots 256-511) points to the
+// same PDP tables in every space, so kernel mappings made anywhere show up everywhere.
+class AddressSpace {
+    public:
+    static AddressSpace* Create();
+    void InitKernel(PageTableManager* kernelTables);
+    void Destroy();
+    void Activate();
+
+    VMA* FindVMA(uint64_t address);
+    VMA* AddVMA(void* start, uint64_t size, uint64_t flags, VMABacking backing, uint64_t offset = 0, void* object = NULL);
+    bool RemoveVMA(void* start);
+    bool HandleFault(uint64_t address, uint64_t errorCode);
+
+    PageTableManager* Tables;
+
+    private:
+    VMA* Root;
+    VMA* FindOverlap(uint64_t start, uint64_t end);
+    void ReleaseVMA(VMA* vma);
+};
+
+extern AddressSpace KernelAddressSpace;
+extern AddressSpace* CurrentAddressSpace;
+
+bool HandleMemoryFault(uint64_t address, uint64_t errorCode);
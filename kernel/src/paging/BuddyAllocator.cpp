@@ -0,0 +1,141 @@
+#include "BuddyAllocator.h"
+#include "../memory.h"
+
+void BuddyAllocator::Init(uint64_t frameCount, PageDescriptor* descriptors){
+    FrameCount = frameCount;
+    Descriptors = descriptors;
+    for (uint8_t order = 0; order <= BUDDY_MAX_ORDER; order++){
+        FreeLists[order] = NULL;
+    }
+}
+
+bool BuddyAllocator::IsFreeHead(uint64_t index, uint8_t order){
+    PageDescriptor* page = &Descriptors[index];
+    return (page->flags & PAGE_FLAG_BUDDY) && page->order == order;
+}
+
+// Largest naturally aligned block that starts at start and fits before end
+static inline uint8_t LargestOrder(uint64_t start, uint64_t end){
+    uint8_t order = 0;
+    while (order < BUDDY_MAX_ORDER){
+        uint64_t size = (uint64_t)1 << (order + 1);
+        if (start & (size - 1)) break;
+        if (start + size > end) break;
+        order++;
+    }
+    return order;
+}
+
+// Seed the free lists from every free run of the lock map
+void BuddyAllocator::Build(Bitmap* lockMap){
+    uint64_t index = lockMap->FindFirstClear(0, FrameCount);
+    while (index < FrameCount){
+        uint64_t runEnd = lockMap->FindFirstSet(index, FrameCount);
+        PushRange(index, runEnd);
+        index = lockMap->FindFirstClear(runEnd, FrameCount);
+    }
+}
+
+uint64_t BuddyAllocator::AllocateBlock(uint8_t order){
+    if (order > BUDDY_MAX_ORDER) return BUDDY_NO_BLOCK;
+
+    uint8_t current = order;
+    while (current <= BUDDY_MAX_ORDER && FreeLists[current] == NULL) current++;
+    if (current > BUDDY_MAX_ORDER) return BUDDY_NO_BLOCK;
+
+    uint64_t index = FreeLists[current] - Descriptors;
+    RemoveBlock(index, current);
+
+    // hand the upper halves back until the block is the requested size
+    while (current > order){
+        current--;
+        PushBlock(index + ((uint64_t)1 << current), current);
+    }
+    return index;
+}
+
+void BuddyAllocator::FreeBlock(uint64_t index, uint8_t order){
+    if (index + ((uint64_t)1 << order) > FrameCount) return;
+
+    while (order < BUDDY_MAX_ORDER){
+        uint64_t buddy = index ^ ((uint64_t)1 << order);
+        if (buddy >= FrameCount) break;
+        if (!IsFreeHead(buddy, order)) break;
+
+        RemoveBlock(buddy, order);
+        index &= ~((uint64_t)1 << order);
+        order++;
+    }
+    PushBlock(index, order);
+}
+
+void BuddyAllocator::FreeRange(uint64_t index, uint64_t count){
+    uint64_t end = index + count;
+    if (end > FrameCount) end = FrameCount;
+    while (index < end){
+        uint8_t order = LargestOrder(index, end);
+        FreeBlock(index, order);
+        index += (uint64_t)1 << order;
+    }
+}
+
+// Take [index, index + count) out of the free blocks covering it, returning the leftovers
+void BuddyAllocator::ClaimRange(uint64_t index, uint64_t count){
+    uint64_t end = index + count;
+    if (end > FrameCount) end = FrameCount;
+    while (index < end){
+        uint64_t head;
+        uint8_t order;
+        if (!FindBlock(index, &head, &order)){
+            index++;
+            continue;
+        }
+
+        uint64_t blockEnd = head + ((uint64_t)1 << order);
+        RemoveBlock(head, order);
+        PushRange(head, index);
+        if (end < blockEnd) PushRange(end, blockEnd);
+        index = blockEnd;
+    }
+}
+
+bool BuddyAllocator::FindBlock(uint64_t index, uint64_t* head, uint8_t* order){
+    for (uint8_t current = 0; current <= BUDDY_MAX_ORDER; current++){
+        uint64_t candidate = index & ~(((uint64_t)1 << current) - 1);
+        if (IsFreeHead(candidate, current)){
+            *head = candidate;
+            *order = current;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pieces of a split free block never have a free buddy, so no coalescing is needed here
+void BuddyAllocator::PushRange(uint64_t start, uint64_t end){
+    while (start < end){
+        uint8_t order = LargestOrder(start, end);
+        PushBlock(start, order);
+        start += (uint64_t)1 << order;
+    }
+}
+
+void BuddyAllocator::PushBlock(uint64_t index, uint8_t order){
+    PageDescriptor* block = &Descriptors[index];
+    block->last = NULL;
+    block->next = FreeLists[order];
+    if (block->next != NULL) block->next->last = block;
+    FreeLists[order] = block;
+    block->flags |= PAGE_FLAG_BUDDY;
+    block->order = order;
+}
+
+void BuddyAllocator::RemoveBlock(uint64_t index, uint8_t order){
+    PageDescriptor* block = &Descriptors[index];
+    if (block->last != NULL) block->last->next = block->next;
+    else FreeLists[order] = block->next;
+    if (block->next != NULL) block->next->last = block->last;
+    block->next = NULL;
+    block->last = NULL;
+    block->flags &= ~PAGE_FLAG_BUDDY;
+}
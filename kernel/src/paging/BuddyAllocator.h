@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "../Bitmap.h"
+#include "PageDescriptor.h"
+
+#define BUDDY_MAX_ORDER 10 // largest block is 2^10 pages (4 MiB)
+#define BUDDY_NO_BLOCK ((uint64_t)-1)
+
+// Free blocks are linked through the page descriptor of their first frame. Block indices are
+// dense frame indices, which stay physically contiguous up to a section and so up to the largest block.
+class BuddyAllocator {
+    public:
+    void Init(uint64_t frameCount, PageDescriptor* descriptors);
+    void Build(Bitmap* lockMap);
+    uint64_t AllocateBlock(uint8_t order);
+    void FreeBlock(uint64_t index, uint8_t order);
+    void FreeRange(uint64_t index, uint64_t count);
+    void ClaimRange(uint64_t index, uint64_t count);
+
+    private:
+    uint64_t FrameCount;
+    PageDescriptor* Descriptors;
+    PageDescriptor* FreeLists[BUDDY_MAX_ORDER + 1];
+    bool IsFreeHead(uint64_t index, uint8_t order);
+    void PushBlock(uint64_t index, uint8_t order);
+    void RemoveBlock(uint64_t index, uint8_t order);
+    void PushRange(uint64_t start, uint64_t end);
+    bool FindBlock(uint64_t index, uint64_t* head, uint8_t* order);
+};
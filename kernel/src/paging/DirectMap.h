@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// The kernel image runs at its load address + KERNEL_VIRTUAL_BASE (kernel.ld), and all of
+// RAM is mapped once more at physical address + DIRECT_MAP_BASE. Frames from the page frame
+// allocator are physical addresses; the kernel touches them through the direct map.
+#define KERNEL_VIRTUAL_BASE 0xffffffff80000000
+#define DIRECT_MAP_BASE 0xffff800000000000
+#define KERNEL_HALF_BASE 0xffff800000000000 // everything from here up is the kernel's, in every address space
+
+inline void* PhysicalToVirtual(uint64_t physicalAddress){
+    return (void*)(physicalAddress + DIRECT_MAP_BASE);
+}
+
+inline void* PhysicalToVirtual(void* physicalAddress){
+    return PhysicalToVirtual((uint64_t)physicalAddress);
+}
+
+// Only for the kernel image and the direct map
+inline uint64_t VirtualToPhysical(void* virtualAddress){
+    uint64_t address = (uint64_t)virtualAddress;
+    if (address >= KERNEL_VIRTUAL_BASE) return address - KERNEL_VIRTUAL_BASE;
+    return address - DIRECT_MAP_BASE;
+}
@@ -0,0 +1,61 @@
+#include "MemorySections.h"
+
+static uint64_t SectionTableSize(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize){
+    uint64_t highestFrame = 0;
+    for (uint64_t i = 0; i < mMapEntries; i++){
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)mMap + (i * mMapDescSize));
+        if (!IsRAMMemoryType(desc->type)) continue;
+        uint64_t end = (uint64_t)desc->physAddr / 4096 + desc->numPages;
+        if (end > highestFrame) highestFrame = end;
+    }
+    return (highestFrame + SECTION_FRAMES - 1) / SECTION_FRAMES;
+}
+
+size_t MemorySections::MetadataSize(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize){
+    // worst case every section is present, which needs the same amount again for the reverse table
+    return SectionTableSize(mMap, mMapEntries, mMapDescSize) * sizeof(uint32_t) * 2;
+}
+
+void MemorySections::Init(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize, void* buffer){
+    TableSize = SectionTableSize(mMap, mMapEntries, mMapDescSize);
+    Table = (uint32_t*)buffer;
+    Present = Table + TableSize;
+
+    for (uint64_t section = 0; section < TableSize; section++){
+        Table[section] = SECTION_NONE;
+    }
+
+    for (uint64_t i = 0; i < mMapEntries; i++){
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)mMap + (i * mMapDescSize));
+        if (!IsRAMMemoryType(desc->type) || desc->numPages == 0) continue;
+        uint64_t first = (uint64_t)desc->physAddr / 4096 / SECTION_FRAMES;
+        uint64_t last = ((uint64_t)desc->physAddr / 4096 + desc->numPages - 1) / SECTION_FRAMES;
+        for (uint64_t section = first; section <= last; section++){
+            Table[section] = 0;
+        }
+    }
+
+    uint32_t presentCount = 0;
+    for (uint64_t section = 0; section < TableSize; section++){
+        if (Table[section] == SECTION_NONE) continue;
+        Table[section] = presentCount;
+        Present[presentCount] = section;
+        presentCount++;
+    }
+
+    FrameCount = presentCount * SECTION_FRAMES;
+}
+
+// Number of frame indices that belong to RAM below pfn
+uint64_t MemorySections::IndexLimit(uint64_t pfn){
+    uint64_t section = pfn / SECTION_FRAMES;
+    if (section >= TableSize) return FrameCount;
+    if (Table[section] != SECTION_NONE) return FrameIndex(pfn);
+
+    // in a hole: everything in the present sections below it
+    while (section > 0){
+        section--;
+        if (Table[section] != SECTION_NONE) return (Table[section] + 1) * SECTION_FRAMES;
+    }
+    return 0;
+}
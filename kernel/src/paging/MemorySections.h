@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "../efiMemory.h"
+
+#define SECTION_SHIFT 27 // 128 MiB sections
+#define SECTION_FRAMES ((uint64_t)1 << (SECTION_SHIFT - 12))
+#define SECTION_NONE 0xffffffff
+#define SECTION_NO_FRAME ((uint64_t)-1)
+
+// Sparse physical memory model. Only sections that hold RAM get frame indices, and those
+// indices are dense so the allocator's per-frame structures never cover holes or MMIO.
+// Sections are numbered in ascending physical order, so index order follows address order.
+class MemorySections {
+    public:
+    static size_t MetadataSize(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize);
+    void Init(EFI_MEMORY_DESCRIPTOR* mMap, uint64_t mMapEntries, uint64_t mMapDescSize, void* buffer);
+    uint64_t IndexLimit(uint64_t pfn);
+    uint64_t FrameCount;
+
+    // physical frame number -> dense frame index, SECTION_NO_FRAME outside RAM sections
+    inline uint64_t FrameIndex(uint64_t pfn){
+        uint64_t section = pfn / SECTION_FRAMES;
+        if (section >= TableSize) return SECTION_NO_FRAME;
+        uint32_t dense = Table[section];
+        if (dense == SECTION_NONE) return SECTION_NO_FRAME;
+        return dense * SECTION_FRAMES + (pfn & (SECTION_FRAMES - 1));
+    }
+
+    inline uint64_t FramePFN(uint64_t index){
+        return (uint64_t)Present[index / SECTION_FRAMES] * SECTION_FRAMES + (index & (SECTION_FRAMES - 1));
+    }
+
+    private:
+    uint64_t TableSize;
+    uint32_t* Table; // section number -> dense section
+    uint32_t* Present; // dense section -> section number
+};
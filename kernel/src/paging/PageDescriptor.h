@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+enum PageFlag {
+    PAGE_FLAG_RESERVED = 1 << 0,  // firmware, MMIO holes inside a section, low memory
+    PAGE_FLAG_LOCKED = 1 << 1,    // pinned by LockPages: kernel image, allocator metadata, framebuffer
+    PAGE_FLAG_ALLOCATED = 1 << 2, // handed out by one of the Request functions
+    PAGE_FLAG_BUDDY = 1 << 3,     // head of a free buddy block, order is valid
+};
+
+enum PageType {
+    PageTypeNone = 0,
+    PageTypeKernel = 1,
+    PageTypePageTable = 2,
+    PageTypeHeap = 3,
+    PageTypeDMA = 4,
+    PageTypeSlab = 5,
+};
+
+// One per dense frame index, two to a cache line. The links are only used while the frame
+// heads a free buddy block, so the free frames themselves are never written by the allocator.
+struct PageDescriptor {
+    PageDescriptor* next;
+    PageDescriptor* last;
+    uint32_t refCount;
+    uint16_t flags; // PageFlag
+    uint8_t order;  // buddy order while PAGE_FLAG_BUDDY is set
+    uint8_t type;   // PageType, set by the owner
+    void* owner;    // back pointer for the owning subsystem
+};
+
+static_assert(sizeof(PageDescriptor) == 32, "PageDescriptor must stay 32 bytes");
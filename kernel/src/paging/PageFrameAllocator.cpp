@@ -1,4 +1,6 @@
 #include "PageFrameAllocator.h"
+#include "../IO.h"
+#include "DirectMap.h"
 
 uint64_t freeMemory;
 uint64_t reservedMemory;
@@ -16,7 +18,7 @@ void PageFrameAllocator::ReadEFIMemoryMap(EFI_MEMORY_DESCRIPTOR* mMap, size_t mM
     void* largestFreeMemSeg = NULL;
     size_t largestFreeMemSegSize = 0;
 
-    for (int i = 0; i < mMapEntries; i++){
+    for (uint64_t i = 0; i < mMapEntries; i++){
         EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)mMap + (i * mMapDescSize));
         if (desc->type == 7){ // type = EfiConventionalMemory
             if (desc->numPages * 4096 > largestFreeMemSegSize)
@@ -27,101 +29,339 @@ void PageFrameAllocator::ReadEFIMemoryMap(EFI_MEMORY_DESCRIPTOR* mMap, size_t mM
         }
     }
 
-    uint64_t memorySize = GetMemorySize(mMap, mMapEntries, mMapDescSize);
-    freeMemory = memorySize;
-    uint64_t bitmapSize = memorySize / 4096 / 8 + 1;
+    // section table first, then the page descriptors, the frame bitmap and its summary, all indexed by dense frame index
+    uint8_t* metadata = (uint8_t*)PhysicalToVirtual(largestFreeMemSeg);
+    uint64_t sectionsSize = (MemorySections::MetadataSize(mMap, mMapEntries, mMapDescSize) + 63) & ~(uint64_t)63;
+    Sections.Init(mMap, mMapEntries, mMapDescSize, metadata);
 
-    InitBitmap(bitmapSize, largestFreeMemSeg);
+    uint64_t frameCount = Sections.FrameCount;
+    uint64_t descriptorsSize = frameCount * sizeof(PageDescriptor);
+    uint64_t bitmapSize = frameCount / 8; // sections are whole words
+    uint64_t summarySize = BitmapSummary::MetadataSize(frameCount);
+    uint64_t metadataSize = sectionsSize + descriptorsSize + bitmapSize + summarySize;
 
-    ReservePages(0, memorySize / 4096 + 1);
-    for (int i = 0; i < mMapEntries; i++){
+    Pages = (PageDescriptor*)(metadata + sectionsSize);
+    memset(Pages, 0, descriptorsSize);
+    InitBitmap(bitmapSize, metadata + sectionsSize + descriptorsSize);
+    PageSummary.Init(&PageBitmap, PageBitmap.Buffer + bitmapSize);
+
+    // every frame of a present section starts out reserved, including the non-RAM parts of partial sections
+    freeMemory = frameCount * 4096;
+    uint64_t reserved = SetFrames(0, frameCount, PAGE_FLAG_RESERVED);
+    freeMemory -= reserved * 4096;
+    reservedMemory += reserved * 4096;
+    for (uint64_t i = 0; i < mMapEntries; i++){
         EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)mMap + (i * mMapDescSize));
         if (desc->type == 7){ // efiConventionalMemory
             UnreservePages(desc->physAddr, desc->numPages);
         }
     }
     ReservePages(0, 0x100); // reserve between 0 and 0x100000
-    LockPages(PageBitmap.Buffer, PageBitmap.Size / 4096 + 1);
+    LockPages(largestFreeMemSeg, metadataSize / 4096 + 1);
+
+    if (Backend == PageFrameBackend::BuddyBackend){
+        Buddy.Init(frameCount, Pages);
+        Buddy.Build(&PageBitmap);
+        BuddyReady = true;
+    }
+}
+
+// Loader code/data and boot services code/data stay reserved until the kernel has copied out
+// everything it still needs from them. keepAddress/keepPages is the kernel image, which the
+// loader placed in EfiLoaderData and which must stay reserved.
+uint64_t PageFrameAllocator::ReclaimBootMemory(EFI_MEMORY_DESCRIPTOR* mMap, size_t mMapSize, size_t mMapDescSize, void* keepAddress, uint64_t keepPages){
+    uint64_t mMapEntries = mMapSize / mMapDescSize;
+    uint64_t keepStart = (uint64_t)keepAddress / 4096;
+    uint64_t keepEnd = keepStart + keepPages;
+    uint64_t freeBefore = freeMemory;
+
+    for (uint64_t i = 0; i < mMapEntries; i++){
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)mMap + (i * mMapDescSize));
+        if (desc->type < 1 || desc->type > 4) continue; // EfiLoaderCode .. EfiBootServicesData
+
+        uint64_t start = (uint64_t)desc->physAddr / 4096;
+        uint64_t end = start + desc->numPages;
+        if (start < 0x100) start = 0x100; // the first megabyte stays reserved
+        if (start >= end) continue;
+
+        if (keepEnd <= start || keepStart >= end){
+            UnreservePages((void*)(start * 4096), end - start);
+            continue;
+        }
+        if (start < keepStart) UnreservePages((void*)(start * 4096), keepStart - start);
+        if (keepEnd < end) UnreservePages((void*)(keepEnd * 4096), end - keepEnd);
+    }
+
+    return freeMemory - freeBefore;
 }
 
 void PageFrameAllocator::InitBitmap(size_t bitmapSize, void* bufferAddress){
     PageBitmap.Size = bitmapSize;
     PageBitmap.Buffer = (uint8_t*)bufferAddress;
-    for (int i = 0; i < bitmapSize; i++){
-        *(uint8_t*)(PageBitmap.Buffer + i) = 0;
+    memset(PageBitmap.Buffer, 0, bitmapSize);
+}
+
+void* PageFrameAllocator::FrameAddress(uint64_t index){
+    return (void*)(Sections.FramePFN(index) * 4096);
+}
+
+// Hands out [index, index + pageCount), which the caller has already found free and taken off the buddy lists
+void* PageFrameAllocator::CommitAllocation(uint64_t index, uint64_t pageCount){
+    PageBitmap.SetRange(index, pageCount);
+    PageSummary.Update(index, pageCount);
+    for (uint64_t i = index; i < index + pageCount; i++){
+        InitDescriptor(i, PAGE_FLAG_ALLOCATED);
     }
+    freeMemory -= pageCount * 4096;
+    usedMemory += pageCount * 4096;
+    return FrameAddress(index);
 }
-uint64_t pageBitmapIndex = 0;
+
 void* PageFrameAllocator::RequestPage(){
-    for (; pageBitmapIndex < PageBitmap.Size * 8; pageBitmapIndex++){
-        if (PageBitmap[pageBitmapIndex] == true) continue;
-        LockPage((void*)(pageBitmapIndex * 4096));
-        return (void*)(pageBitmapIndex * 4096);
+    if (BuddyReady) return RequestPages(0);
+
+    uint64_t index = PageSummary.FindFirstClear(0);
+    if (index >= Sections.FrameCount) return NULL; // Page Frame Swap to file
+
+    return CommitAllocation(index, 1);
+}
+
+// Takes a frame from the pre-zeroed pool, zeroing one inline only when the pool is empty
+void* PageFrameAllocator::RequestZeroedPage(){
+    void* page = NULL;
+    uint64_t flags = DisableInterrupts();
+    if (ZeroedPoolCount > 0) page = ZeroedPool[--ZeroedPoolCount];
+    RestoreInterrupts(flags);
+    if (page != NULL) return page;
+
+    page = RequestPage();
+    if (page != NULL) memset(PhysicalToVirtual(page), 0, 0x1000);
+    return page;
+}
+
+// Zeroes one frame into the pool. Called from the idle loop, returns false once the pool is full.
+// Pooled frames are already allocated, so they count as used memory.
+bool PageFrameAllocator::RefillZeroedPool(){
+    if (ZeroedPoolCount >= PFA_ZERO_POOL_SIZE) return false;
+
+    void* page = RequestPage();
+    if (page == NULL) return false;
+    memset(PhysicalToVirtual(page), 0, 0x1000);
+
+    uint64_t flags = DisableInterrupts();
+    bool pooled = ZeroedPoolCount < PFA_ZERO_POOL_SIZE;
+    if (pooled) ZeroedPool[ZeroedPoolCount++] = page;
+    RestoreInterrupts(flags);
+
+    if (!pooled) FreePage(page);
+    return pooled;
+}
+
+// Returns 2^order physically contiguous pages aligned to their own size
+void* PageFrameAllocator::RequestPages(uint8_t order){
+    uint64_t pageCount = (uint64_t)1 << order;
+
+    if (BuddyReady){
+        uint64_t index = Buddy.AllocateBlock(order);
+        if (index == BUDDY_NO_BLOCK) return NULL;
+        return CommitAllocation(index, pageCount);
     }
 
-    return NULL; // Page Frame Swap to file
+    uint64_t index = FindFreeRun(pageCount, pageCount, Sections.FrameCount);
+    if (index == PFA_NO_FRAME) return NULL;
+
+    return CommitAllocation(index, pageCount);
 }
 
-void PageFrameAllocator::FreePage(void* address){
-    uint64_t index = (uint64_t)address / 4096;
-    if (PageBitmap[index] == false) return;
-    if (PageBitmap.Set(index, false)){
-        freeMemory += 4096;
-        usedMemory -= 4096;
-        if (pageBitmapIndex > index) pageBitmapIndex = index;
+// Physically contiguous run of pageCount frames starting on an alignment boundary (bytes, power of two)
+// and ending at or below maxPhysAddr, e.g. 0x100000000 for devices limited to 32-bit DMA
+void* PageFrameAllocator::RequestContiguousPages(uint64_t pageCount, uint64_t alignment, uint64_t maxPhysAddr){
+    if (pageCount == 0) return NULL;
+
+    uint64_t alignPages = alignment / 4096;
+    if (alignPages == 0) alignPages = 1;
+
+    uint64_t limit = Sections.IndexLimit(maxPhysAddr / 4096);
+
+    if (BuddyReady){
+        // buddy blocks are naturally aligned, so take the smallest one that covers both size and alignment
+        uint8_t order = 0;
+        while (((uint64_t)1 << order) < pageCount || ((uint64_t)1 << order) < alignPages) order++;
+
+        if (order <= BUDDY_MAX_ORDER){
+            uint64_t index = Buddy.AllocateBlock(order);
+            if (index != BUDDY_NO_BLOCK){
+                if (index + pageCount <= limit){
+                    Buddy.FreeRange(index + pageCount, ((uint64_t)1 << order) - pageCount);
+                    return CommitAllocation(index, pageCount);
+                }
+                Buddy.FreeBlock(index, order);
+            }
+        }
     }
+
+    // the buddy block was too high, too large or missing; a bitmap run still sits on the free lists
+    uint64_t index = FindFreeRun(pageCount, alignPages, limit);
+    if (index == PFA_NO_FRAME) return NULL;
+    if (BuddyReady) Buddy.ClaimRange(index, pageCount);
+
+    return CommitAllocation(index, pageCount);
 }
 
-void PageFrameAllocator::FreePages(void* address, uint64_t pageCount){
-    for (int t = 0; t < pageCount; t++){
-        FreePage((void*)((uint64_t)address + (t * 4096)));
+void PageFrameAllocator::FreeContiguousPages(void* address, uint64_t pageCount){
+    FreePages(address, pageCount);
+}
+
+uint64_t PageFrameAllocator::FindFreeRun(uint64_t pageCount, uint64_t alignPages, uint64_t limit){
+    // below a section, index alignment is physical alignment; above it only section starts can qualify
+    uint64_t indexAlign = alignPages < SECTION_FRAMES ? alignPages : SECTION_FRAMES;
+
+    uint64_t index = PageSummary.FindFirstClear(0);
+    while (index < limit){
+        index = (index + indexAlign - 1) & ~(indexAlign - 1);
+        if (index + pageCount > limit) break;
+
+        uint64_t pfn = Sections.FramePFN(index);
+        bool contiguous = Sections.FramePFN(index + pageCount - 1) - pfn == pageCount - 1;
+        if ((pfn & (alignPages - 1)) != 0 || !contiguous){
+            index = PageSummary.FindFirstClear((index / SECTION_FRAMES + 1) * SECTION_FRAMES);
+            continue;
+        }
+
+        uint64_t used = PageBitmap.FindFirstSet(index, index + pageCount);
+        if (used == index + pageCount) return index;
+        index = PageSummary.FindFirstClear(used);
     }
+
+    return PFA_NO_FRAME;
 }
 
-void PageFrameAllocator::LockPage(void* address){
-    uint64_t index = (uint64_t)address / 4096;
-    if (PageBitmap[index] == true) return;
-    if (PageBitmap.Set(index, true)){
-        freeMemory -= 4096;
-        usedMemory += 4096;
+void PageFrameAllocator::InitDescriptor(uint64_t index, uint16_t flags){
+    PageDescriptor* page = &Pages[index];
+    page->next = NULL;
+    page->last = NULL;
+    page->refCount = flags & (PAGE_FLAG_ALLOCATED | PAGE_FLAG_LOCKED) ? 1 : 0;
+    page->flags = flags;
+    page->order = 0;
+    page->type = PageTypeNone;
+    page->owner = NULL;
+}
+
+// Marks dense frames [index, index + count) as taken with the given flags, returning how many were free before.
+// Frames that were already taken keep their descriptors.
+uint64_t PageFrameAllocator::SetFrames(uint64_t index, uint64_t count, uint16_t flags){
+    uint64_t end = index + count;
+    uint64_t run = PageBitmap.FindFirstClear(index, end);
+    while (run < end){
+        uint64_t runEnd = PageBitmap.FindFirstSet(run, end);
+        if (BuddyReady) Buddy.ClaimRange(run, runEnd - run);
+        for (uint64_t i = run; i < runEnd; i++){
+            InitDescriptor(i, flags);
+        }
+        run = PageBitmap.FindFirstClear(runEnd, end);
     }
+
+    uint64_t changed = PageBitmap.SetRange(index, count);
+    PageSummary.Update(index, count);
+    return changed;
 }
 
-void PageFrameAllocator::LockPages(void* address, uint64_t pageCount){
-    for (int t = 0; t < pageCount; t++){
-        LockPage((void*)((uint64_t)address + (t * 4096)));
+uint64_t PageFrameAllocator::ClearFrames(uint64_t index, uint64_t count){
+    uint64_t end = index + count;
+    uint64_t run = PageBitmap.FindFirstSet(index, end);
+    while (run < end){
+        uint64_t runEnd = PageBitmap.FindFirstClear(run, end);
+        for (uint64_t i = run; i < runEnd; i++){
+            InitDescriptor(i, 0);
+        }
+        if (BuddyReady) Buddy.FreeRange(run, runEnd - run);
+        run = PageBitmap.FindFirstSet(runEnd, end);
     }
+
+    uint64_t changed = PageBitmap.ClearRange(index, count);
+    PageSummary.Update(index, count);
+    return changed;
 }
 
-void PageFrameAllocator::UnreservePage(void* address){
-    uint64_t index = (uint64_t)address / 4096;
-    if (PageBitmap[index] == false) return;
-    if (PageBitmap.Set(index, false)){
-        freeMemory += 4096;
-        reservedMemory -= 4096;
-        if (pageBitmapIndex > index) pageBitmapIndex = index;
+// Physical ranges are split at section boundaries; parts outside RAM sections are ignored
+// flags == 0 frees the range
+uint64_t PageFrameAllocator::UpdatePhysicalRange(void* address, uint64_t pageCount, uint16_t flags){
+    uint64_t pfn = (uint64_t)address / 4096;
+    uint64_t end = pfn + pageCount;
+    uint64_t changed = 0;
+
+    while (pfn < end){
+        uint64_t chunkEnd = (pfn / SECTION_FRAMES + 1) * SECTION_FRAMES;
+        if (chunkEnd > end) chunkEnd = end;
+
+        uint64_t index = Sections.FrameIndex(pfn);
+        if (index != SECTION_NO_FRAME){
+            changed += flags ? SetFrames(index, chunkEnd - pfn, flags) : ClearFrames(index, chunkEnd - pfn);
+        }
+        pfn = chunkEnd;
     }
+
+    return changed;
+}
+
+void PageFrameAllocator::FreePage(void* address){
+    FreePages(address, 1);
+}
+
+void PageFrameAllocator::FreePages(void* address, uint64_t pageCount){
+    uint64_t freed = UpdatePhysicalRange(address, pageCount, 0);
+    freeMemory += freed * 4096;
+    usedMemory -= freed * 4096;
+}
+
+void PageFrameAllocator::LockPage(void* address){
+    LockPages(address, 1);
+}
+
+void PageFrameAllocator::LockPages(void* address, uint64_t pageCount){
+    uint64_t locked = UpdatePhysicalRange(address, pageCount, PAGE_FLAG_LOCKED);
+    freeMemory -= locked * 4096;
+    usedMemory += locked * 4096;
+}
+
+void PageFrameAllocator::UnreservePage(void* address){
+    UnreservePages(address, 1);
 }
 
 void PageFrameAllocator::UnreservePages(void* address, uint64_t pageCount){
-    for (int t = 0; t < pageCount; t++){
-        UnreservePage((void*)((uint64_t)address + (t * 4096)));
-    }
+    uint64_t unreserved = UpdatePhysicalRange(address, pageCount, 0);
+    freeMemory += unreserved * 4096;
+    reservedMemory -= unreserved * 4096;
 }
 
 void PageFrameAllocator::ReservePage(void* address){
-    uint64_t index = (uint64_t)address / 4096;
-    if (PageBitmap[index] == true) return;
-    if (PageBitmap.Set(index, true)){
-        freeMemory -= 4096;
-        reservedMemory += 4096;
-    }
+    ReservePages(address, 1);
 }
 
 void PageFrameAllocator::ReservePages(void* address, uint64_t pageCount){
-    for (int t = 0; t < pageCount; t++){
-        ReservePage((void*)((uint64_t)address + (t * 4096)));
-    }
+    uint64_t reserved = UpdatePhysicalRange(address, pageCount, PAGE_FLAG_RESERVED);
+    freeMemory -= reserved * 4096;
+    reservedMemory += reserved * 4096;
+}
+
+PageDescriptor* PageFrameAllocator::GetPageDescriptor(void* address){
+    uint64_t index = Sections.FrameIndex((uint64_t)address / 4096);
+    if (index == SECTION_NO_FRAME) return NULL;
+    return &Pages[index];
+}
+
+// Takes another reference on an allocated frame, e.g. when it gets mapped a second time
+void PageFrameAllocator::GetPage(void* address){
+    PageDescriptor* page = GetPageDescriptor(address);
+    if (page == NULL || page->refCount == 0) return;
+    page->refCount++;
+}
+
+// Drops a reference, freeing the frame with the last one
+void PageFrameAllocator::PutPage(void* address){
+    PageDescriptor* page = GetPageDescriptor(address);
+    if (page == NULL || page->refCount == 0) return;
+    if (--page->refCount == 0) FreePage(address);
 }
 
 uint64_t PageFrameAllocator::GetFreeRAM(){
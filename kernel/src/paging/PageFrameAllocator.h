@@ -2,28 +2,64 @@
 #include "../efiMemory.h"
 #include <stdint.h>
 #include "../Bitmap.h"
+#include "../BitmapSummary.h"
 #include "../memory.h"
+#include "BuddyAllocator.h"
+#include "MemorySections.h"
+#include "PageDescriptor.h"
+
+#define PFA_NO_FRAME ((uint64_t)-1)
+#define PFA_ZERO_POOL_SIZE 64 // pre-zeroed frames kept ready by the idle loop
+
+enum PageFrameBackend {
+    BitmapBackend = 0,
+    BuddyBackend = 1,
+};
 
 class PageFrameAllocator {
     public:
     void ReadEFIMemoryMap(EFI_MEMORY_DESCRIPTOR* mMap, size_t mMapSize, size_t mMapDescSize);
-    Bitmap PageBitmap;
+    uint64_t ReclaimBootMemory(EFI_MEMORY_DESCRIPTOR* mMap, size_t mMapSize, size_t mMapDescSize, void* keepAddress, uint64_t keepPages);
+    Bitmap PageBitmap; // indexed by dense frame index, see MemorySections
+    MemorySections Sections;
+    PageDescriptor* Pages; // one descriptor per dense frame index
+    PageFrameBackend Backend = PageFrameBackend::BitmapBackend;
     void FreePage(void* address);
     void FreePages(void* address, uint64_t pageCount);
     void LockPage(void* address);
     void LockPages(void* address, uint64_t pageCount);
     void* RequestPage();
+    void* RequestZeroedPage();
+    bool RefillZeroedPool();
+    void* RequestPages(uint8_t order);
+    void* RequestContiguousPages(uint64_t pageCount, uint64_t alignment, uint64_t maxPhysAddr);
+    void FreeContiguousPages(void* address, uint64_t pageCount);
+    PageDescriptor* GetPageDescriptor(void* address);
+    void GetPage(void* address);
+    void PutPage(void* address);
     uint64_t GetFreeRAM();
     uint64_t GetUsedRAM();
     uint64_t GetReservedRAM();
 
 
     private:
+    BitmapSummary PageSummary;
+    BuddyAllocator Buddy;
+    bool BuddyReady = false;
+    void* ZeroedPool[PFA_ZERO_POOL_SIZE];
+    volatile uint64_t ZeroedPoolCount = 0;
     void InitBitmap(size_t bitmapSize, void* bufferAddress);
     void ReservePage(void* address);
     void ReservePages(void* address, uint64_t pageCount);
     void UnreservePage(void* address);
     void UnreservePages(void* address, uint64_t pageCount);
+    void* FrameAddress(uint64_t index);
+    void* CommitAllocation(uint64_t index, uint64_t pageCount);
+    void InitDescriptor(uint64_t index, uint16_t flags);
+    uint64_t SetFrames(uint64_t index, uint64_t count, uint16_t flags);
+    uint64_t ClearFrames(uint64_t index, uint64_t count);
+    uint64_t UpdatePhysicalRange(void* address, uint64_t pageCount, uint16_t flags);
+    uint64_t FindFreeRun(uint64_t pageCount, uint64_t alignPages, uint64_t limit);
 
 };
 
@@ -3,66 +3,308 @@
 #include <stdint.h>
 #include "PageFrameAllocator.h"
 #include "../memory.h"
+#include "../cpu.h"
+#include "DirectMap.h"
+#include "TLB.h"
 
 PageTableManager g_PageTableManager = NULL;
 
 PageTableManager::PageTableManager(PageTable* PML4Address){
     this->PML4 = PML4Address;
+    this->PCID = PCID_KERNEL;
+    this->StaleTLB = true;
+}
+
+#define CR3_ADDRESS_MASK 0x000ffffffffff000
+
+// Loads these tables. With PCIDs the space's own TLB entries survive the switch, unless
+// something changed while it was not loaded or it shares PCID_KERNEL with other spaces.
+void PageTableManager::Activate(){
+    uint64_t cr3 = VirtualToPhysical(PML4);
+    if (PCIDEnabled){
+        cr3 |= PCID;
+        if (PCID != PCID_KERNEL && !StaleTLB) cr3 |= CR3_NO_FLUSH;
+    }
+    StaleTLB = false;
+    WriteCR3(cr3);
+}
+
+// Page tables hold physical addresses; the tables themselves are reached through the direct map
+static inline PageTable* TableAt(PageDirectoryEntry entry){
+    return (PageTable*)PhysicalToVirtual(entry.GetAddress() << 12);
+}
+
+// PageMapFlag bits as they sit in an entry; bit 7 is the size bit of a large page, so its PAT bit lives at 12
+static inline uint64_t EntryBits(uint64_t flags, bool large){
+    uint64_t bits = flags & PAGE_MAP_FLAG_MASK & ~(uint64_t)PageMapPAT;
+    if (flags & PageMapPAT) bits |= (uint64_t)1 << (large ? PT_Flag::LargePAT : PT_Flag::LargerPages);
+    return bits;
+}
+
+// Returns the table an entry points to, allocating it if the entry is empty. A large page
+// (entrySize says how large) is split into a table of smaller pages with the same translation.
+// Intermediate entries stay writable and only pick up PageMapUser; the leaf decides the rest.
+PageTable* PageTableManager::GetNextTable(PageTable* table, uint64_t index, PageSize entrySize, uint64_t flags){
+    PageDirectoryEntry PDE = table->entries[index];
+    if (PDE.GetFlag(PT_Flag::Present) && !PDE.GetFlag(PT_Flag::LargerPages)){
+        if (flags & PageMapUser) table->entries[index].SetFlag(PT_Flag::UserSuper, true);
+        return TableAt(PDE);
+    }
+
+    void* frame = GlobalAllocator.RequestZeroedPage();
+    PageTable* next = (PageTable*)PhysicalToVirtual(frame);
+
+    if (PDE.GetFlag(PT_Flag::Present)){
+        uint64_t childSize = entrySize == PageSize::Page1GiB ? PAGE_SIZE_2MIB : PAGE_SIZE_4KIB;
+        uint64_t base = (PDE.GetAddress() << 12) & ~(childSize * 512 - 1);
+        bool pat = PDE.GetFlag(PT_Flag::LargePAT);
+        for (uint64_t i = 0; i < 512; i++){
+            PageDirectoryEntry child = PDE;
+            child.SetAddress((base + i * childSize) >> 12);
+            if (entrySize == PageSize::Page1GiB) child.SetFlag(PT_Flag::LargePAT, pat);
+            else child.SetFlag(PT_Flag::LargerPages, pat); // the 4 KiB PAT bit
+            next->entries[i] = child;
+        }
+        PDE.SetFlag(PT_Flag::LargerPages, false);
+        PDE.SetFlag(PT_Flag::WriteThrough, false);
+        PDE.SetFlag(PT_Flag::CacheDisabled, false);
+    }
+
+    PDE.SetAddress((uint64_t)frame >> 12);
+    PDE.SetFlag(PT_Flag::Present, true);
+    PDE.SetFlag(PT_Flag::ReadWrite, true);
+    PDE.SetFlag(PT_Flag::UserSuper, PDE.GetFlag(PT_Flag::UserSuper) || (flags & PageMapUser));
+    table->entries[index] = PDE;
+    return next;
 }
 
 void PageTableManager::MapMemory(void* virtualMemory, void* physicalMemory){
-    PageMapIndexer indexer = PageMapIndexer((uint64_t)virtualMemory);
-    PageDirectoryEntry PDE;
-
-    PDE = PML4->entries[indexer.PDP_i];
-    PageTable* PDP;
-    if (!PDE.GetFlag(PT_Flag::Present)){
-        PDP = (PageTable*)GlobalAllocator.RequestPage();
-        memset(PDP, 0, 0x1000);
-        PDE.SetAddress((uint64_t)PDP >> 12);
-        PDE.SetFlag(PT_Flag::Present, true);
-        PDE.SetFlag(PT_Flag::ReadWrite, true);
-        PML4->entries[indexer.PDP_i] = PDE;
+    MapRange(virtualMemory, physicalMemory, 1, PAGE_MAP_DEFAULT);
+}
+
+// Puts a 2 MiB (PD) or 1 GiB (PDP) page into table[index]. Fails rather than replacing a
+// table that already maps smaller pages there.
+bool PageTableManager::MapLargePage(PageTable* table, uint64_t index, uint64_t physicalMemory, uint64_t flags){
+    PageDirectoryEntry PDE = table->entries[index];
+    if (PDE.GetFlag(PT_Flag::Present) && !PDE.GetFlag(PT_Flag::LargerPages)) return false;
+
+    PDE.Value = 0;
+    PDE.SetAddress(physicalMemory >> 12);
+    PDE.Value |= EntryBits(flags, true) | ((uint64_t)1 << PT_Flag::Present) | ((uint64_t)1 << PT_Flag::LargerPages);
+    table->entries[index] = PDE;
+    return true;
+}
+
+// Maps pageCount 4 KiB pages with the given PageMapFlag bits, using the largest page size that
+// both addresses are aligned to and that fits in what is left, so only the unaligned edges end
+// up in 4 KiB page tables. Each page table is walked to once and then filled in a tight loop.
+void PageTableManager::MapRange(void* virtualMemory, void* physicalMemory, uint64_t pageCount, uint64_t flags){
+    static int hugePages = -1;
+    if (hugePages < 0) hugePages = CPUSupports1GiBPages() ? 1 : 0;
+
+    uint64_t virt = (uint64_t)virtualMemory;
+    uint64_t phys = (uint64_t)physicalMemory;
+    uint64_t end = virt + pageCount * PAGE_SIZE_4KIB;
+    if (virt >= KERNEL_HALF_BASE) flags |= PageMapGlobal; // the same in every address space
+    uint64_t leaf = EntryBits(flags, false) | ((uint64_t)1 << PT_Flag::Present);
+
+    while (virt < end){
+        PageMapIndexer indexer = PageMapIndexer(virt);
+        uint64_t aligned = virt | phys;
+
+        PageTable* PDP = GetNextTable(PML4, indexer.PDP_i, PageSize::Page4KiB, flags);
+        if (hugePages && (aligned & (PAGE_SIZE_1GIB - 1)) == 0 && end - virt >= PAGE_SIZE_1GIB
+            && MapLargePage(PDP, indexer.PD_i, phys, flags)){
+            virt += PAGE_SIZE_1GIB;
+            phys += PAGE_SIZE_1GIB;
+            continue;
+        }
+
+        PageTable* PD = GetNextTable(PDP, indexer.PD_i, PageSize::Page1GiB, flags);
+        if ((aligned & (PAGE_SIZE_2MIB - 1)) == 0 && end - virt >= PAGE_SIZE_2MIB
+            && MapLargePage(PD, indexer.PT_i, phys, flags)){
+            virt += PAGE_SIZE_2MIB;
+            phys += PAGE_SIZE_2MIB;
+            continue;
+        }
+
+        // fill to the end of this page table; the next one starts 2 MiB aligned again
+        PageTable* PT = GetNextTable(PD, indexer.PT_i, PageSize::Page2MiB, flags);
+        for (uint64_t i = indexer.P_i; i < 512 && virt < end; i++){
+            PageDirectoryEntry PDE;
+            PDE.Value = leaf;
+            PDE.SetAddress(phys >> 12);
+            PT->entries[i] = PDE;
+            virt += PAGE_SIZE_4KIB;
+            phys += PAGE_SIZE_4KIB;
+        }
     }
-    else
-    {
-        PDP = (PageTable*)((uint64_t)PDE.GetAddress() << 12);
+}
+
+
+void PageTableManager::UnmapRange(void* virtualMemory, uint64_t pageCount){
+    UpdateRange((uint64_t)virtualMemory, pageCount, true, 0);
+}
+
+// Replaces the PageMapFlag bits of every mapped page in the range, leaving holes alone
+void PageTableManager::ProtectRange(void* virtualMemory, uint64_t pageCount, uint64_t flags){
+    UpdateRange((uint64_t)virtualMemory, pageCount, false, flags);
+}
+
+// Physical address behind a virtual one, or PAGE_NOT_MAPPED
+uint64_t PageTableManager::Translate(void* virtualMemory){
+    uint64_t virt = (uint64_t)virtualMemory;
+    PageMapIndexer indexer = PageMapIndexer(virt);
+
+    PageDirectoryEntry PDE = PML4->entries[indexer.PDP_i];
+    if (!PDE.GetFlag(PT_Flag::Present)) return PAGE_NOT_MAPPED;
+
+    PDE = TableAt(PDE)->entries[indexer.PD_i];
+    if (!PDE.GetFlag(PT_Flag::Present)) return PAGE_NOT_MAPPED;
+    if (PDE.GetFlag(PT_Flag::LargerPages)) return ((PDE.GetAddress() << 12) & ~(PAGE_SIZE_1GIB - 1)) + (virt & (PAGE_SIZE_1GIB - 1));
+
+    PDE = TableAt(PDE)->entries[indexer.PT_i];
+    if (!PDE.GetFlag(PT_Flag::Present)) return PAGE_NOT_MAPPED;
+    if (PDE.GetFlag(PT_Flag::LargerPages)) return ((PDE.GetAddress() << 12) & ~(PAGE_SIZE_2MIB - 1)) + (virt & (PAGE_SIZE_2MIB - 1));
+
+    PDE = TableAt(PDE)->entries[indexer.P_i];
+    if (!PDE.GetFlag(PT_Flag::Present)) return PAGE_NOT_MAPPED;
+    return (PDE.GetAddress() << 12) + (virt & (PAGE_SIZE_4KIB - 1));
+}
+
+// Clears a leaf or rewrites its flags; returns whether it changed
+bool PageTableManager::UpdateEntry(PageDirectoryEntry* entry, bool large, bool unmap, uint64_t flags){
+    if (!entry->GetFlag(PT_Flag::Present)) return false;
+    uint64_t value = unmap ? 0 : (entry->Value & ~EntryBits(PAGE_MAP_FLAG_MASK, large)) | EntryBits(flags, large);
+    if (value == entry->Value) return false;
+    entry->Value = value;
+    return true;
+}
+
+static inline uint64_t NextBoundary(uint64_t virt, uint64_t size){
+    return (virt | (size - 1)) + 1;
+}
+
+static inline bool TableEmpty(PageTable* table){
+    for (uint64_t i = 0; i < 512; i++){
+        if (table->entries[i].Value != 0) return false;
     }
-    
-    
-    PDE = PDP->entries[indexer.PD_i];
-    PageTable* PD;
-    if (!PDE.GetFlag(PT_Flag::Present)){
-        PD = (PageTable*)GlobalAllocator.RequestPage();
-        memset(PD, 0, 0x1000);
-        PDE.SetAddress((uint64_t)PD >> 12);
-        PDE.SetFlag(PT_Flag::Present, true);
-        PDE.SetFlag(PT_Flag::ReadWrite, true);
-        PDP->entries[indexer.PD_i] = PDE;
+    return true;
+}
+
+// Walks the range once. Large pages that are only partly covered get split first; large pages
+// that are fully covered are changed as a whole.
+void PageTableManager::UpdateRange(uint64_t virt, uint64_t pageCount, bool unmap, uint64_t flags){
+    uint64_t start = virt;
+    uint64_t end = virt + pageCount * PAGE_SIZE_4KIB;
+    bool changed = false;
+    if (virt >= KERNEL_HALF_BASE) flags |= PageMapGlobal;
+    bool tablesFreed = false;
+
+    while (virt < end){
+        PageMapIndexer indexer = PageMapIndexer(virt);
+
+        PageDirectoryEntry* PDE = &PML4->entries[indexer.PDP_i];
+        if (!PDE->GetFlag(PT_Flag::Present)){
+            virt = NextBoundary(virt, PAGE_SIZE_1GIB * 512);
+            continue;
+        }
+        PageTable* PDP = TableAt(*PDE);
+
+        PDE = &PDP->entries[indexer.PD_i];
+        if (!PDE->GetFlag(PT_Flag::Present)){
+            virt = NextBoundary(virt, PAGE_SIZE_1GIB);
+            continue;
+        }
+        if (PDE->GetFlag(PT_Flag::LargerPages)){
+            if ((virt & (PAGE_SIZE_1GIB - 1)) == 0 && end - virt >= PAGE_SIZE_1GIB){
+                changed |= UpdateEntry(PDE, true, unmap, flags);
+                virt += PAGE_SIZE_1GIB;
+                if (unmap) tablesFreed |= PruneTables(virt - PAGE_SIZE_1GIB);
+                continue;
+            }
+            GetNextTable(PDP, indexer.PD_i, PageSize::Page1GiB, 0);
+        }
+        PageTable* PD = TableAt(*PDE);
+
+        PDE = &PD->entries[indexer.PT_i];
+        if (!PDE->GetFlag(PT_Flag::Present)){
+            virt = NextBoundary(virt, PAGE_SIZE_2MIB);
+            continue;
+        }
+        if (PDE->GetFlag(PT_Flag::LargerPages)){
+            if ((virt & (PAGE_SIZE_2MIB - 1)) == 0 && end - virt >= PAGE_SIZE_2MIB){
+                changed |= UpdateEntry(PDE, true, unmap, flags);
+                virt += PAGE_SIZE_2MIB;
+                if (unmap) tablesFreed |= PruneTables(virt - PAGE_SIZE_2MIB);
+                continue;
+            }
+            GetNextTable(PD, indexer.PT_i, PageSize::Page2MiB, 0);
+        }
+        PageTable* PT = TableAt(*PDE);
+
+        uint64_t tableStart = virt;
+        for (uint64_t i = indexer.P_i; i < 512 && virt < end; i++){
+            changed |= UpdateEntry(&PT->entries[i], false, unmap, flags);
+            virt += PAGE_SIZE_4KIB;
+        }
+        if (unmap) tablesFreed |= PruneTables(tableStart);
     }
-    else
-    {
-        PD = (PageTable*)((uint64_t)PDE.GetAddress() << 12);
+
+    // freed tables must not stay in the paging-structure caches, so they always force a full flush
+    if (changed || tablesFreed) Invalidate(start, pageCount, tablesFreed);
+}
+
+// Frees the page tables above virt that no longer map anything, bottom up. The PML4 stays.
+// Returns whether any table was freed.
+bool PageTableManager::PruneTables(uint64_t virt){
+    PageMapIndexer indexer = PageMapIndexer(virt);
+    PageTable* tables[3];
+    PageDirectoryEntry* entries[3];
+
+    entries[0] = &PML4->entries[indexer.PDP_i];
+    if (!entries[0]->GetFlag(PT_Flag::Present)) return false;
+    tables[0] = TableAt(*entries[0]);
+
+    entries[1] = &tables[0]->entries[indexer.PD_i];
+    uint8_t depth = 1;
+    if (entries[1]->GetFlag(PT_Flag::Present) && !entries[1]->GetFlag(PT_Flag::LargerPages)){
+        tables[1] = TableAt(*entries[1]);
+        entries[2] = &tables[1]->entries[indexer.PT_i];
+        depth = 2;
+        if (entries[2]->GetFlag(PT_Flag::Present) && !entries[2]->GetFlag(PT_Flag::LargerPages)){
+            tables[2] = TableAt(*entries[2]);
+            depth = 3;
+        }
     }
 
-    PDE = PD->entries[indexer.PT_i];
-    PageTable* PT;
-    if (!PDE.GetFlag(PT_Flag::Present)){
-        PT = (PageTable*)GlobalAllocator.RequestPage();
-        memset(PT, 0, 0x1000);
-        PDE.SetAddress((uint64_t)PT >> 12);
-        PDE.SetFlag(PT_Flag::Present, true);
-        PDE.SetFlag(PT_Flag::ReadWrite, true);
-        PD->entries[indexer.PT_i] = PDE;
+    bool freed = false;
+    while (depth > 0){
+        depth--;
+        if (depth == 0 && virt >= KERNEL_HALF_BASE) break; // kernel half PDP tables are shared by every PML4
+        if (!TableEmpty(tables[depth])) break;
+        GlobalAllocator.FreePage((void*)VirtualToPhysical(tables[depth]));
+        entries[depth]->Value = 0;
+        freed = true;
     }
-    else
-    {
-        PT = (PageTable*)((uint64_t)PDE.GetAddress() << 12);
+    return freed;
+}
+
+// Kernel half entries are global and shared by every address space, so they are flushed even
+// when these tables are not loaded. Anything else only needs flushing while it is live; an
+// inactive space just flushes its PCID the next time it is activated.
+void PageTableManager::Invalidate(uint64_t virt, uint64_t pageCount, bool full){
+    bool active = (ReadCR3() & CR3_ADDRESS_MASK) == VirtualToPhysical(PML4);
+    if (!active){
+        StaleTLB = true;
+        if (virt < KERNEL_HALF_BASE) return;
     }
 
-    PDE = PT->entries[indexer.P_i];
-    PDE.SetAddress((uint64_t)physicalMemory >> 12);
-    PDE.SetFlag(PT_Flag::Present, true);
-    PDE.SetFlag(PT_Flag::ReadWrite, true);
-    PT->entries[indexer.P_i] = PDE;
-}
\ No newline at end of file
+    if (full || pageCount > TLB_FLUSH_THRESHOLD){
+        FlushTLB();
+        return;
+    }
+    for (uint64_t i = 0; i < pageCount; i++){
+        asm volatile ("invlpg (%0)" : : "r"(virt + i * PAGE_SIZE_4KIB) : "memory");
+    }
+}
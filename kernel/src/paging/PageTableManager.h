@@ -1,11 +1,29 @@
 #pragma once
 #include "paging.h"
 
+#define PAGE_NOT_MAPPED ((uint64_t)-1)
+#define TLB_FLUSH_THRESHOLD 32 // pages; larger invalidations reload CR3 instead of using invlpg
+
 class PageTableManager {
     public:
     PageTableManager(PageTable* PML4Address);
-    PageTable* PML4;
+    PageTable* PML4; // direct map address, VirtualToPhysical gives the CR3 value
+    uint16_t PCID; // see AllocatePCID
+    void Activate();
     void MapMemory(void* virtualMemory, void* physicalMemory);
+    void MapRange(void* virtualMemory, void* physicalMemory, uint64_t pageCount, uint64_t flags = PAGE_MAP_DEFAULT);
+    void UnmapRange(void* virtualMemory, uint64_t pageCount);
+    void ProtectRange(void* virtualMemory, uint64_t pageCount, uint64_t flags);
+    uint64_t Translate(void* virtualMemory);
+
+    private:
+    bool StaleTLB; // entries tagged with PCID may be out of date, flush on the next Activate
+    PageTable* GetNextTable(PageTable* table, uint64_t index, PageSize entrySize, uint64_t flags);
+    bool MapLargePage(PageTable* table, uint64_t index, uint64_t physicalMemory, uint64_t flags);
+    void UpdateRange(uint64_t virt, uint64_t pageCount, bool unmap, uint64_t flags);
+    bool UpdateEntry(PageDirectoryEntry* entry, bool large, bool unmap, uint64_t flags);
+    bool PruneTables(uint64_t virt);
+    void Invalidate(uint64_t virt, uint64_t pageCount, bool full);
 };
 
-extern PageTableManager g_PageTableManager;
\ No newline at end of file
+extern PageTableManager g_PageTableManager;
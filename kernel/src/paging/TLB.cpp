@@ -0,0 +1,60 @@
+#include "TLB.h"
+#include "../cpu.h"
+#include "../alternatives.h"
+#include "../Bitmap.h"
+
+bool GlobalPagesEnabled = false;
+bool PCIDEnabled = false;
+
+static uint8_t pcidBuffer[PCID_COUNT / 8] __attribute__((aligned(8)));
+static Bitmap pcidMap;
+
+// Turns on CR4.PGE and, where the CPU has it, CR4.PCIDE. Must run with a CR3 whose low 12 bits
+// are clear, i.e. PCID_KERNEL.
+void EnableTLBFeatures(){
+    uint64_t cr4 = ReadCR4();
+    if (CPUSupportsPGE()){
+        cr4 |= CR4_PGE;
+        GlobalPagesEnabled = true;
+    }
+    if (CPUSupportsPCID()){
+        cr4 |= CR4_PCIDE;
+        PCIDEnabled = true;
+    }
+    WriteCR4(cr4);
+
+    pcidMap.Size = sizeof(pcidBuffer);
+    pcidMap.Buffer = pcidBuffer;
+    pcidMap.Set(PCID_KERNEL, true);
+}
+
+// Drops every TLB entry, global ones and those of other PCIDs included
+void FlushTLB(){
+    if (CPUHas<CPU_FEATURE_INVPCID>()){
+        uint64_t descriptor[2] = {0, 0};
+        asm volatile ("invpcid %0, %1" : : "m"(descriptor), "r"((uint64_t)INVPCID_ALL_GLOBAL) : "memory");
+        return;
+    }
+    if (GlobalPagesEnabled){
+        uint64_t cr4 = ReadCR4();
+        WriteCR4(cr4 & ~(uint64_t)CR4_PGE);
+        WriteCR4(cr4);
+        return;
+    }
+    WriteCR3(ReadCR3() & ~CR3_NO_FLUSH);
+}
+
+// Returns PCID_KERNEL when PCIDs are off or used up; such spaces flush on every switch
+uint16_t AllocatePCID(){
+    if (!PCIDEnabled) return PCID_KERNEL;
+    uint64_t pcid = pcidMap.FindFirstClear(0, PCID_COUNT);
+    if (pcid >= PCID_COUNT) return PCID_KERNEL;
+    pcidMap.Set(pcid, true);
+    return (uint16_t)pcid;
+}
+
+// The caller must make sure nothing tagged with the PCID stays in the TLB, see PageTableManager::Activate
+void FreePCID(uint16_t pcid){
+    if (pcid == PCID_KERNEL) return;
+    pcidMap.Set(pcid, false);
+}
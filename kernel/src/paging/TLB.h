@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+#define PCID_COUNT 4096
+#define PCID_KERNEL 0 // the boot address space; also shared by everyone once the PCIDs run out
+#define CR3_NO_FLUSH ((uint64_t)1 << 63) // with PCIDE, keep the new PCID's TLB entries
+#define INVPCID_ALL_GLOBAL 2 // invpcid type: every PCID, global entries included
+
+extern bool GlobalPagesEnabled;
+extern bool PCIDEnabled;
+
+void EnableTLBFeatures();
+void FlushTLB();
+uint16_t AllocatePCID();
+void FreePCID(uint16_t pcid);
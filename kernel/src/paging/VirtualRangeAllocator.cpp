@@ -0,0 +1,214 @@
+#include "VirtualRangeAllocator.h"
+#include "../memory/slab.h"
+
+static SlabCache* RangeCache;
+
+static inline int32_t Height(VirtualRange* node){
+    return node == NULL ? 0 : node->height;
+}
+
+static inline uint64_t Largest(VirtualRange* node){
+    return node == NULL ? 0 : node->largest;
+}
+
+static void UpdateNode(VirtualRange* node){
+    int32_t left = Height(node->left);
+    int32_t right = Height(node->right);
+    node->height = (left > right ? left : right) + 1;
+
+    uint64_t largest = node->end - node->start;
+    if (Largest(node->left) > largest) largest = Largest(node->left);
+    if (Largest(node->right) > largest) largest = Largest(node->right);
+    node->largest = largest;
+}
+
+static VirtualRange* RotateRight(VirtualRange* node){
+    VirtualRange* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    UpdateNode(node);
+    UpdateNode(pivot);
+    return pivot;
+}
+
+static VirtualRange* RotateLeft(VirtualRange* node){
+    VirtualRange* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    UpdateNode(node);
+    UpdateNode(pivot);
+    return pivot;
+}
+
+static VirtualRange* Balance(VirtualRange* node){
+    UpdateNode(node);
+    int32_t factor = Height(node->left) - Height(node->right);
+    if (factor > 1){
+        if (Height(node->left->left) < Height(node->left->right)) node->left = RotateLeft(node->left);
+        return RotateRight(node);
+    }
+    if (factor < -1){
+        if (Height(node->right->right) < Height(node->right->left)) node->right = RotateRight(node->right);
+        return RotateLeft(node);
+    }
+    return node;
+}
+
+static VirtualRange* Insert(VirtualRange* node, VirtualRange* range){
+    if (node == NULL) return range;
+    if (range->start < node->start) node->left = Insert(node->left, range);
+    else node->right = Insert(node->right, range);
+    return Balance(node);
+}
+
+static VirtualRange* DetachMin(VirtualRange* node, VirtualRange** min){
+    if (node->left == NULL){
+        *min = node;
+        return node->right;
+    }
+    node->left = DetachMin(node->left, min);
+    return Balance(node);
+}
+
+static VirtualRange* Remove(VirtualRange* node, uint64_t start){
+    if (node == NULL) return NULL;
+    if (start < node->start){
+        node->left = Remove(node->left, start);
+        return Balance(node);
+    }
+    if (start > node->start){
+        node->right = Remove(node->right, start);
+        return Balance(node);
+    }
+
+    if (node->right == NULL) return node->left;
+    VirtualRange* successor;
+    VirtualRange* right = DetachMin(node->right, &successor);
+    successor->left = node->left;
+    successor->right = right;
+    return Balance(successor);
+}
+
+// Recomputes largest along the path to the node keyed start, after it grew or shrank in place
+static void Refresh(VirtualRange* node, uint64_t start){
+    if (node == NULL) return;
+    if (start < node->start) Refresh(node->left, start);
+    else if (start > node->start) Refresh(node->right, start);
+    UpdateNode(node);
+}
+
+static inline uint64_t AlignUp(uint64_t value, uint64_t alignment){
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline bool Fits(VirtualRange* range, uint64_t size, uint64_t alignment){
+    uint64_t start = AlignUp(range->start, alignment);
+    return start >= range->start && start < range->end && range->end - start >= size;
+}
+
+// Lowest range the request fits in. Subtrees whose largest range is too small are skipped.
+static VirtualRange* FindFit(VirtualRange* node, uint64_t size, uint64_t alignment){
+    if (node == NULL || node->largest < size) return NULL;
+
+    VirtualRange* found = FindFit(node->left, size, alignment);
+    if (found != NULL) return found;
+    if (Fits(node, size, alignment)) return node;
+    return FindFit(node->right, size, alignment);
+}
+
+// Returns false when no node can be allocated; the window then stays empty and every Allocate fails
+bool VirtualRangeAllocator::Init(uint64_t base, uint64_t size){
+    Root = NULL;
+    if (RangeCache == NULL) RangeCache = kmem_cache_create(sizeof(VirtualRange), 0, NULL);
+    if (RangeCache == NULL) return false;
+
+    Root = (VirtualRange*)kmem_cache_alloc(RangeCache);
+    if (Root == NULL) return false;
+    Root->start = base;
+    Root->end = base + size;
+    Root->left = NULL;
+    Root->right = NULL;
+    UpdateNode(Root);
+    return true;
+}
+
+// size and alignment are bytes, multiples of the page size; alignment is a power of two
+uint64_t VirtualRangeAllocator::Allocate(uint64_t size, uint64_t alignment){
+    if (size == 0) return VRANGE_NO_SPACE;
+    if (alignment < 0x1000) alignment = 0x1000;
+
+    VirtualRange* range = FindFit(Root, size, alignment);
+    if (range == NULL) return VRANGE_NO_SPACE;
+
+    uint64_t start = AlignUp(range->start, alignment);
+    uint64_t end = start + size;
+    uint64_t rangeEnd = range->end;
+
+    // shrinking a range in place keeps the tree ordered, only the tail needs a new node
+    if (start == range->start){
+        if (end == rangeEnd){
+            Root = Remove(Root, range->start);
+            kmem_cache_free(RangeCache, range);
+            return start;
+        }
+        range->start = end;
+        Refresh(Root, range->start);
+        return start;
+    }
+
+    range->end = start;
+    Refresh(Root, range->start);
+    if (end < rangeEnd){
+        VirtualRange* tail = (VirtualRange*)kmem_cache_alloc(RangeCache);
+        if (tail == NULL) return start; // out of memory: the tail stays unusable rather than failing the caller
+        tail->start = end;
+        tail->end = rangeEnd;
+        tail->left = NULL;
+        tail->right = NULL;
+        UpdateNode(tail);
+        Root = Insert(Root, tail);
+    }
+    return start;
+}
+
+void VirtualRangeAllocator::Free(uint64_t start, uint64_t size){
+    uint64_t end = start + size;
+
+    // free neighbours: the range ending at start and the one beginning at end
+    VirtualRange* before = NULL;
+    VirtualRange* after = NULL;
+    VirtualRange* node = Root;
+    while (node != NULL){
+        if (node->end == start) before = node;
+        if (node->start == end) after = node;
+        node = start < node->start ? node->left : node->right;
+    }
+
+    if (before != NULL && after != NULL){
+        uint64_t afterStart = after->start;
+        before->end = after->end;
+        Root = Remove(Root, afterStart);
+        kmem_cache_free(RangeCache, after);
+        Refresh(Root, before->start);
+        return;
+    }
+    if (before != NULL){
+        before->end = end;
+        Refresh(Root, before->start);
+        return;
+    }
+    if (after != NULL){
+        after->start = start;
+        Refresh(Root, after->start);
+        return;
+    }
+
+    VirtualRange* range = (VirtualRange*)kmem_cache_alloc(RangeCache);
+    if (range == NULL) return;
+    range->start = start;
+    range->end = end;
+    range->left = NULL;
+    range->right = NULL;
+    UpdateNode(range);
+    Root = Insert(Root, range);
+}
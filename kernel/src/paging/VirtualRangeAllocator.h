@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define VRANGE_NO_SPACE ((uint64_t)-1)
+
+// A free range of kernel virtual addresses, a node of an AVL tree keyed by start. largest is
+// the size of the biggest range in the node's subtree, so a fit is found without a full walk.
+struct VirtualRange {
+    uint64_t start;
+    uint64_t end;
+    uint64_t largest;
+    VirtualRange* left;
+    VirtualRange* right;
+    int32_t height;
+};
+
+// Hands out page aligned pieces of one window of kernel virtual space, lowest address first.
+// Freed pieces merge back with their free neighbours. Nodes come from a slab cache.
+class VirtualRangeAllocator {
+    public:
+    bool Init(uint64_t base, uint64_t size);
+    uint64_t Allocate(uint64_t size, uint64_t alignment);
+    void Free(uint64_t start, uint64_t size);
+
+    private:
+    VirtualRange* Root;
+};
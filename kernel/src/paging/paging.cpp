@@ -1,4 +1,16 @@
 #include "paging.h"
+#include "../cpu.h"
+
+// PA0 WB, PA1 WT, PA2 UC-, PA3 UC as after reset, PA4 WC, PA5 WP, PA6 UC-, PA7 UC
+#define PAT_LAYOUT 0x0007050100070406
+
+// Must run before the kernel's page tables are loaded, the CR3 switch flushes the TLB.
+// Every x86_64 CPU has PAT; the check only guards against odd emulators.
+void ConfigurePAT(){
+    if (!CPUSupportsPAT()) return;
+    asm volatile ("wbinvd" : : : "memory");
+    WriteMSR(MSR_IA32_PAT, PAT_LAYOUT);
+}
 
 void PageDirectoryEntry::SetFlag(PT_Flag flag, bool enabled){
     uint64_t bitSelector = (uint64_t)1 << flag;
@@ -10,7 +22,7 @@ void PageDirectoryEntry::SetFlag(PT_Flag flag, bool enabled){
 
 bool PageDirectoryEntry::GetFlag(PT_Flag flag){
     uint64_t bitSelector = (uint64_t)1 << flag;
-    return Value & bitSelector > 0 ? true : false;
+    return (Value & bitSelector) != 0;
 }
 
 uint64_t PageDirectoryEntry::GetAddress(){
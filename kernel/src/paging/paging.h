@@ -8,13 +8,44 @@ enum PT_Flag {
     WriteThrough = 3,
     CacheDisabled = 4,
     Accessed = 5,
-    LargerPages = 7,
+    LargerPages = 7, // PAT in a 4 KiB entry
+    Global = 8, // only with CR4.PGE
     Custom0 = 9,
     Custom1 = 10,
     Custom2 = 11,
+    LargePAT = 12, // PAT in a 2 MiB / 1 GiB entry
     NX = 63 // only if supported
 };
 
+enum PageSize {
+    Page4KiB = 0,
+    Page2MiB = 1, // PD entry with LargerPages
+    Page1GiB = 2, // PDP entry with LargerPages, needs CPUSupports1GiBPages
+};
+
+// Leaf entry bits accepted by PageTableManager::MapRange, at their PT_Flag positions
+enum PageMapFlag {
+    PageMapWrite = 1 << PT_Flag::ReadWrite,
+    PageMapUser = 1 << PT_Flag::UserSuper,
+    PageMapWriteThrough = 1 << PT_Flag::WriteThrough,
+    PageMapCacheDisabled = 1 << PT_Flag::CacheDisabled,
+    PageMapPAT = 1 << PT_Flag::LargerPages, // moved to LargePAT for large pages
+    PageMapGlobal = 1 << PT_Flag::Global, // added by MapRange for everything in the kernel half
+};
+
+// Memory types for MapRange, PAT index = PAT:PCD:PWT with the layout ConfigurePAT programs
+#define PAGE_MAP_WB 0
+#define PAGE_MAP_WT ((uint64_t)PageMapWriteThrough)
+#define PAGE_MAP_UC ((uint64_t)(PageMapCacheDisabled | PageMapWriteThrough))
+#define PAGE_MAP_WC ((uint64_t)PageMapPAT)
+
+#define PAGE_MAP_DEFAULT ((uint64_t)PageMapFlag::PageMapWrite | PAGE_MAP_WB)
+#define PAGE_MAP_FLAG_MASK ((uint64_t)(PageMapWrite | PageMapUser | PageMapWriteThrough | PageMapCacheDisabled | PageMapPAT | PageMapGlobal))
+
+#define PAGE_SIZE_4KIB 0x1000ULL
+#define PAGE_SIZE_2MIB 0x200000ULL
+#define PAGE_SIZE_1GIB 0x40000000ULL
+
 struct PageDirectoryEntry {
     uint64_t Value;
     void SetFlag(PT_Flag flag, bool enabled);
@@ -23,6 +54,8 @@ struct PageDirectoryEntry {
     uint64_t GetAddress();
 };
 
+void ConfigurePAT();
+
 struct PageTable { 
     PageDirectoryEntry entries [512];
 }__attribute__((aligned(0x1000)));
\ No newline at end of file
@@ -5,6 +5,11 @@
 void Panic(const char* panicMessage){
     // Disable interrupts to prevent further faults
     asm ("cli");
+
+    // Draw straight to the framebuffer, the back buffer or scrollback may be what faulted
+    GlobalRenderer->BackBuffer = NULL;
+    GlobalRenderer->FlushOnTick = false;
+    GlobalRenderer->History = NULL;
     
     GlobalRenderer->ClearColour = 0x00ff0000;
     GlobalRenderer->Clear();
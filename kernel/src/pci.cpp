@@ -2,6 +2,8 @@
 #include "ahci/ahci.h"
 #include "memory/heap.h"
 #include "printf.h"
+#include "memory/vmalloc.h"
+#include "paging/paging.h"
 
 namespace PCI{
 
@@ -9,8 +11,6 @@ namespace PCI{
         uint64_t offset = function << 12;
 
         uint64_t functionAddress = deviceAddress + offset;
-        g_PageTableManager.MapMemory((void*)functionAddress, (void*)functionAddress);
-
         PCIDeviceHeader* pciDeviceHeader = (PCIDeviceHeader*)functionAddress;
 
         if (pciDeviceHeader->DeviceID == 0) return;
@@ -39,8 +39,6 @@ namespace PCI{
         uint64_t offset = device << 15;
 
         uint64_t deviceAddress = busAddress + offset;
-        g_PageTableManager.MapMemory((void*)deviceAddress, (void*)deviceAddress);
-
         PCIDeviceHeader* pciDeviceHeader = (PCIDeviceHeader*)deviceAddress;
 
         if (pciDeviceHeader->DeviceID == 0) return;
@@ -55,8 +53,6 @@ namespace PCI{
         uint64_t offset = bus << 20;
 
         uint64_t busAddress = baseAddress + offset;
-        g_PageTableManager.MapMemory((void*)busAddress, (void*)busAddress);
-
         PCIDeviceHeader* pciDeviceHeader = (PCIDeviceHeader*)busAddress;
 
         if (pciDeviceHeader->DeviceID == 0) return;
@@ -71,8 +67,16 @@ namespace PCI{
         int entries = ((mcfg->Header.Length) - sizeof(ACPI::MCFGHeader)) / sizeof(ACPI::DeviceConfig);
         for (int t = 0; t < entries; t++){
             ACPI::DeviceConfig* newDeviceConfig = (ACPI::DeviceConfig*)((uint64_t)mcfg + sizeof(ACPI::MCFGHeader) + (sizeof(ACPI::DeviceConfig) * t));
+
+            // the configuration space of every bus in the segment, 1 MiB per bus, mapped in one go
+            uint64_t ecamBase = newDeviceConfig->BaseAddress + ((uint64_t)newDeviceConfig->StartBus << 20);
+            uint64_t ecamPages = ((uint64_t)(newDeviceConfig->EndBus - newDeviceConfig->StartBus + 1) << 20) / 0x1000;
+            uint64_t ecam = (uint64_t)ioremap(ecamBase, ecamPages * 0x1000, PAGE_MAP_UC);
+            if (ecam == 0) continue;
+            uint64_t segmentBase = ecam - ((uint64_t)newDeviceConfig->StartBus << 20); // EnumerateBus adds bus << 20
+
             for (uint64_t bus = newDeviceConfig->StartBus; bus < newDeviceConfig->EndBus; bus++){
-                EnumerateBus(newDeviceConfig->BaseAddress, bus);
+                EnumerateBus(segmentBase, bus);
             }
         }
     }
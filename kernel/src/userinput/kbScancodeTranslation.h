@@ -8,6 +8,8 @@ namespace QWERTYKeyboard{
     #define Enter 0x1C
     #define BackSpace 0x0E
     #define Spacebar 0x39
+    #define PageUp 0x49 // also keypad 9; the 0xE0 prefix of the dedicated key is ignored
+    #define PageDown 0x51 // also keypad 3
 
     extern const char ASCIITable[];
     char Translate(uint8_t scancode, bool uppercase);
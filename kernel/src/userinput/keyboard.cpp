@@ -27,6 +27,12 @@ void HandleKeyboard(uint8_t scancode){
         case BackSpace:
            GlobalRenderer->ClearChar();
            return;
+        case PageUp:
+            GlobalRenderer->ScrollView(GlobalRenderer->TargetFramebuffer->Height / 16);
+            return;
+        case PageDown:
+            GlobalRenderer->ScrollView(-(long)(GlobalRenderer->TargetFramebuffer->Height / 16));
+            return;
     }
 
     char ascii = QWERTYKeyboard::Translate(scancode, isLeftShiftPressed | isRightShiftPressed);